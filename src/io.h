@@ -246,6 +246,7 @@ enum {
   UEP_R_RES_NAK = 0x80,    // UEPx_CTRL, Handshake nak response for EPn RX
   UEP_R_RES_STALL = 0xc0,  // UEPx_CTRL, Handshake stall response for EPn RX
   bUEP_AUTO_TOG = 0x10,    // UEPx_CTRL, automatic toggle
+  bUH_PRE_PID_EN = 0x80,   // UH_SETUP, USB host PRE PID for low speed via hub
   bUH_SOF_EN = 0x40,       // UH_SETUP, USB host automatic SOF enable
   bUIE_BUS_RST = 0x01,     // USB_INT_EN, USB bus reset event (device)
   bUIE_DETECT = 0x01,      // USB_INT_EN, USB device detected event (host)
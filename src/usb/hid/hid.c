@@ -7,6 +7,7 @@
 #include <string.h>
 
 #include "../../ch559.h"
+#include "../../flash.h"
 #include "../usb.h"
 #if !defined(_HID_NO_PS3)
 #include "hid_dualshock3.h"
@@ -18,9 +19,6 @@
 #if !defined(_HID_NO_KEYBOARD)
 #include "hid_keyboard.h"
 #endif
-#if !defined(_HID_NO_MOUSE)
-#include "hid_mouse.h"
-#endif
 #if !defined(_HID_NO_SWITCH)
 #include "hid_switch.h"
 #endif
@@ -35,23 +33,313 @@
 
 static struct hid* hid;
 static struct usb_host host;
-static struct hid_info hid_info[2];
-static struct usb_info usb_info[2];
+static struct hid_info hid_info[USB_HOST_MAX_DEVICES];
+static struct usb_info usb_info[USB_HOST_MAX_DEVICES];
+static struct usb_host_request in_request[USB_HOST_MAX_DEVICES];
+static bool in_pending[USB_HOST_MAX_DEVICES];
+// Reports are received here directly by DMA. DMA addresses must be even.
+static uint8_t _report_buffer[USB_HOST_MAX_DEVICES][64 + 1];
+static uint8_t* report_buffer[USB_HOST_MAX_DEVICES];
+
+// A field that spans up to 3 bytes in a report.
+struct field {
+  uint8_t index;  // first byte following the report ID
+  uint8_t bytes;  // 0 if not available
+  uint8_t shift;  // bit position in the first byte
+  uint16_t mask;  // field bits
+  uint8_t scale;  // left shift to make a 16-bit value
+  uint16_t flip;  // xor to make it signed, and to invert the polarity
+};
+
+// A 1-bit field.
+struct bit {
+  uint8_t index;
+  uint8_t mask;  // 0 if not available
+};
+
+// Extraction plan compiled from hid_info so that hid_decode() takes a fixed
+// number of byte operations per field.
+struct plan {
+  uint8_t report_id;
+  uint8_t size;  // bytes that fields need
+  struct bit button[13];
+  struct bit dpad[4];
+  struct field hat;
+  struct field axis[6];
+};
+static struct plan plan[USB_HOST_MAX_DEVICES];
+
+// Hat switch positions from north to north-west in clockwise, and null.
+static const uint8_t hat_dpad[16] = {
+    HID_DPAD_UP,
+    HID_DPAD_UP | HID_DPAD_RIGHT,
+    HID_DPAD_RIGHT,
+    HID_DPAD_DOWN | HID_DPAD_RIGHT,
+    HID_DPAD_DOWN,
+    HID_DPAD_DOWN | HID_DPAD_LEFT,
+    HID_DPAD_LEFT,
+    HID_DPAD_UP | HID_DPAD_LEFT,
+};
+// The last state that on_change reported.
+static struct hid_gamepad_state gamepad[USB_HOST_MAX_DEVICES];
+
+// Bump this when the cached format or the parser result changes.
+static const uint8_t cache_version = 2;
+static struct hid_cache_entry cache_entry[USB_HOST_MAX_DEVICES];
+static struct hid_cache_entry cache_read_buffer;
+static bool cached[USB_HOST_MAX_DEVICES];
+
+// Devices that are recognized by descriptors. `data` is the HID type. Kept in
+// code flash, and walked once for the device, and once for each interface.
+static const struct usb_host_id ids[] = {
+#if !defined(_HID_NO_KEYBOARD)
+    {USB_HOST_MATCH_CLASS, 0, 0, USB_CLASS_HID, USB_HID_SUBCLASS_BOOT,
+     USB_HID_PROTOCOL_KEYBOARD, 0, HID_TYPE_KEYBOARD},
+#endif
+#if !defined(_HID_NO_MOUSE)
+    {USB_HOST_MATCH_CLASS, 0, 0, USB_CLASS_HID, USB_HID_SUBCLASS_BOOT,
+     USB_HID_PROTOCOL_MOUSE, 0, HID_TYPE_MOUSE},
+    // AimTrak needs to use multiple interfaces.
+    // As a basic support, let's use the 3rd interface to obtain the point
+    // address, and the trigger click inside or outside the screen.
+    // Red buttons in left and right cannot be accessed here, as they need to
+    // tweak the 2nd interface with bInterfaceNumber == 1.
+    {USB_HOST_MATCH_VENDOR | USB_HOST_MATCH_PRODUCT | USB_HOST_MATCH_INTERFACE,
+     0xd209, 0x1601, 0, 0, 0, 2, HID_TYPE_MOUSE},
+#endif
+#if !defined(_HID_NO_XBOX)
+    // Microsoft Xbox 360 / ONE official controllers.
+    {USB_HOST_MATCH_VENDOR | USB_HOST_MATCH_PRODUCT, 0x045e, 0x028e, 0, 0, 0,
+     0, HID_TYPE_XBOX_360},
+    {USB_HOST_MATCH_VENDOR | USB_HOST_MATCH_PRODUCT, 0x045e, 0x02d1, 0, 0, 0,
+     0, HID_TYPE_XBOX_ONE},
+    {USB_HOST_MATCH_VENDOR | USB_HOST_MATCH_PRODUCT, 0x045e, 0x02dd, 0, 0, 0,
+     0, HID_TYPE_XBOX_ONE},
+    {USB_HOST_MATCH_VENDOR | USB_HOST_MATCH_PRODUCT, 0x045e, 0x02e3, 0, 0, 0,
+     0, HID_TYPE_XBOX_ONE},
+    {USB_HOST_MATCH_VENDOR | USB_HOST_MATCH_PRODUCT, 0x045e, 0x02ea, 0, 0, 0,
+     0, HID_TYPE_XBOX_ONE},
+    {USB_HOST_MATCH_VENDOR | USB_HOST_MATCH_PRODUCT, 0x045e, 0x0b00, 0, 0, 0,
+     0, HID_TYPE_XBOX_ONE},
+    {USB_HOST_MATCH_VENDOR | USB_HOST_MATCH_PRODUCT, 0x045e, 0x0b0a, 0, 0, 0,
+     0, HID_TYPE_XBOX_ONE},
+    {USB_HOST_MATCH_VENDOR | USB_HOST_MATCH_PRODUCT, 0x045e, 0x0b12, 0, 0, 0,
+     0, HID_TYPE_XBOX_ONE},
+    // Might be Xbox 360 / ONE compatible controllers.
+    {USB_HOST_MATCH_CLASS, 0, 0, 0xff, 0x5d, 0x01, 0, HID_TYPE_XBOX_360},
+    {USB_HOST_MATCH_CLASS, 0, 0, 0xff, 0x47, 0xd0, 0, HID_TYPE_XBOX_ONE},
+#endif
+#if !defined(_HID_NO_SWITCH)
+    // Nintendo Switch Pro Controller, and Charging Grip.
+    {USB_HOST_MATCH_VENDOR | USB_HOST_MATCH_PRODUCT, 0x057e, 0x2009, 0, 0, 0,
+     0, HID_TYPE_SWITCH},
+    {USB_HOST_MATCH_VENDOR | USB_HOST_MATCH_PRODUCT, 0x057e, 0x200e, 0, 0, 0,
+     0, HID_TYPE_SWITCH},
+#endif
+#if !defined(_HID_NO_GUNCON3)
+#if USB_HOST_MAX_DEVICES <= 2
+    // GunCon3 built-in hub.
+    {USB_HOST_MATCH_VENDOR | USB_HOST_MATCH_PRODUCT, 0x0c12, 0x8801, 0, 0, 0,
+     0, HID_TYPE_ZAPPER},
+#endif
+    {USB_HOST_MATCH_VENDOR | USB_HOST_MATCH_PRODUCT, 0x0b9a, 0x0800, 0, 0, 0,
+     0, HID_TYPE_ZAPPER},
+#endif
+#if !defined(_HID_NO_PS3)
+    {USB_HOST_MATCH_VENDOR | USB_HOST_MATCH_PRODUCT, 0x054c, 0x0268, 0, 0, 0,
+     0, HID_TYPE_PS3},
+#endif
+};
 
 static void do_nothing(void) {}
 
+static uint16_t cache_offset(uint8_t hub) {
+  const struct hid_cache_entry* key = &cache_entry[hub];
+  uint8_t slot = (uint8_t)(key->vid ^ key->pid) % hid->cache_entries;
+  return hid->cache_offset + sizeof(struct hid_cache_entry) * slot;
+}
+
+static bool cache_load(uint8_t hub, const struct usb_host_configuration* conf) {
+  struct hid_cache_entry* key = &cache_entry[hub];
+  key->version = cache_version;
+  key->vid = usb_info[hub].vid;
+  key->pid = usb_info[hub].pid;
+  key->device = usb_info[hub].device;
+  key->configuration_size = conf->total_length;
+  key->configuration_hash = conf->hash;
+  if (!hid->cache_entries) {
+    return false;
+  }
+  struct hid_cache_entry* entry = &cache_read_buffer;
+  if (!flash_read(cache_offset(hub), (uint8_t*)entry, sizeof(*entry)) ||
+      entry->version != key->version || entry->vid != key->vid ||
+      entry->pid != key->pid || entry->device != key->device ||
+      entry->configuration_size != key->configuration_size ||
+      entry->configuration_hash != key->configuration_hash) {
+    return false;
+  }
+  // Only the layout is restored. The device gets ready in poll_device() once
+  // usb_host finishes the enumeration.
+  uint8_t state = hid_info[hub].state;
+  hid_info[hub] = entry->hid_info;
+  hid_info[hub].state = state;
+  usb_info[hub].get_report_value = entry->get_report_value;
+  usb_info[hub].get_report_length = entry->get_report_length;
+  return true;
+}
+
+static void cache_store(uint8_t hub) {
+  if (!hid->cache_entries || cached[hub]) {
+    return;
+  }
+  struct hid_cache_entry* entry = &cache_entry[hub];
+  entry->get_report_value = usb_info[hub].get_report_value;
+  entry->get_report_length = usb_info[hub].get_report_length;
+  entry->hid_info = hid_info[hub];
+  // The state is not a part of the layout.
+  entry->hid_info.state = HID_STATE_DISCONNECTED;
+  const uint16_t offset = cache_offset(hub);
+  struct hid_cache_entry* stored = &cache_read_buffer;
+  if (flash_read(offset, (uint8_t*)stored, sizeof(*stored)) &&
+      !memcmp(stored, entry, sizeof(*entry))) {
+    return;  // Saves the data flash from rewriting the same contents.
+  }
+  flash_write(offset, (const uint8_t*)entry, sizeof(*entry));
+}
+
+static void compile_bit(struct plan* p, struct bit* b, uint16_t pos) {
+  if (pos >= 0x800) {  // not available, or out of 255 bytes
+    b->index = 0;
+    b->mask = 0;
+    return;
+  }
+  b->index = pos >> 3;
+  b->mask = 1 << (pos & 7);
+  if (p->size <= b->index)
+    p->size = b->index + 1;
+}
+
+static void compile_field(struct plan* p,
+                          struct field* f,
+                          uint16_t pos,
+                          uint8_t size) {
+  f->bytes = 0;
+  if (pos >= 0x800 || !size || size > 16)
+    return;
+  f->index = pos >> 3;
+  f->shift = pos & 7;
+  f->bytes = (f->shift + size + 7) >> 3;
+  f->mask = (size == 16) ? 0xffff : ((1 << size) - 1);
+  f->scale = 16 - size;
+  f->flip = 0;
+  if (p->size < f->index + f->bytes)
+    p->size = f->index + f->bytes;
+}
+
+static void compile_plan(uint8_t hub) {
+  const struct hid_info* info = &hid_info[hub];
+  struct plan* p = &plan[hub];
+  p->report_id = info->report_id;
+  p->size = 0;
+  for (uint8_t i = 0; i < 13; ++i) {
+    compile_bit(p, &p->button[i], info->button[i]);
+  }
+  for (uint8_t i = 0; i < 4; ++i) {
+    compile_bit(p, &p->dpad[i], info->dpad[i]);
+  }
+  compile_field(p, &p->hat, info->hat, 4);
+  for (uint8_t i = 0; i < 6; ++i) {
+    struct field* f = &p->axis[i];
+    compile_field(p, f, info->axis[i], info->axis_size[i]);
+    f->scale += info->axis_shift[i];
+    if (f->scale > 15)
+      f->scale = 15;
+    f->flip = (info->axis_sign[i] ? 0 : 0x8000) ^
+              (info->axis_polarity[i] ? 0xffff : 0);
+  }
+}
+
+static uint16_t read_field(const uint8_t* data, const struct field* f) {
+  const uint8_t* p = &data[f->index];
+  uint16_t value = p[0];
+  if (f->bytes > 1)
+    value |= p[1] << 8;
+  value >>= f->shift;
+  if (f->bytes > 2)
+    value |= p[2] << (16 - f->shift);
+  return value & f->mask;
+}
+
+static bool is_cached(uint8_t hub) {
+  return cached[hub];
+}
+
+static void update_gamepad(uint8_t hub,
+                           const struct hid_gamepad_state* state) {
+  if (!memcmp(&gamepad[hub], state, sizeof(*state))) {
+    return;
+  }
+  gamepad[hub] = *state;
+  hid->on_change(hub, &gamepad[hub]);
+}
+
 static void disconnected(uint8_t hub) {
   hid_info[hub].state = HID_STATE_DISCONNECTED;
   hid_info[hub].report_size = 0;
+  if (hid->on_change) {
+    // Release everything that the device held.
+    struct hid_gamepad_state state;
+    memset(&state, 0, sizeof(state));
+    update_gamepad(hub, &state);
+  }
   if (!hid->report) {
     return;
   }
   hid->report(hub, &hid_info[hub], 0, 0);
 }
 
+static const struct usb_host_id* match(uint8_t hub,
+                                       const struct usb_host_interface* intf) {
+  struct usb_host_device device;
+  device.vid = usb_info[hub].vid;
+  device.pid = usb_info[hub].pid;
+  device.class_code = usb_info[hub].class;
+  device.subclass = usb_info[hub].subclass;
+  device.protocol = usb_info[hub].protocol;
+  return usb_host_match(ids, sizeof(ids) / sizeof(ids[0]), &device, intf);
+}
+
+static void probe(uint8_t hub, const struct usb_host_id* id) {
+  hid_info[hub].type = id->data;
+  switch (id->data) {
+#if !defined(_HID_NO_XBOX)
+    case HID_TYPE_XBOX_360:
+    case HID_TYPE_XBOX_ONE:
+      hid_xbox_probe(&hid_info[hub]);
+      break;
+#endif
+#if !defined(_HID_NO_SWITCH)
+    case HID_TYPE_SWITCH:
+      hid_switch_probe(&usb_info[hub]);
+      break;
+#endif
+#if !defined(_HID_NO_GUNCON3)
+    case HID_TYPE_ZAPPER:
+      hid_guncon3_probe(&usb_info[hub], id);
+      break;
+#endif
+#if !defined(_HID_NO_PS3)
+    case HID_TYPE_PS3:
+      hid_dualshock3_probe(&usb_info[hub]);
+      break;
+#endif
+  }
+}
+
 static void check_device_desc(uint8_t hub, const uint8_t* data) {
   hid_info[hub].report_desc_size = 0;
   hid_info[hub].state = HID_STATE_CONNECTED;
+  cached[hub] = false;
   hid_info[hub].type = HID_TYPE_UNKNOWN;
   const struct usb_desc_device* desc = (const struct usb_desc_device*)data;
 
@@ -78,103 +366,64 @@ static void check_device_desc(uint8_t hub, const uint8_t* data) {
     usb_info[hub].wait = 750;
   }
 
-  if (false ||
-#if !defined(_HID_NO_KEYBOARD)
-      hid_keyboard_check_device_desc(&hid_info[hub], desc) ||
-#endif
-#if !defined(_HID_NO_MOUSE)
-      hid_mouse_check_device_desc(&hid_info[hub], desc) ||
-#endif
-#if !defined(_HID_NO_XBOX)
-      hid_xbox_check_device_desc(&hid_info[hub], desc) ||
-#endif
-#if !defined(_HID_NO_SWITCH)
-      hid_switch_check_device_desc(&hid_info[hub], &usb_info[hub], desc) ||
-#endif
-#if !defined(_HID_NO_GUNCON3)
-      hid_guncon3_check_device_desc(&hid_info[hub], &usb_info[hub], desc) ||
-#endif
-#if !defined(_HID_NO_PS3)
-      hid_dualshock3_check_device_desc(&hid_info[hub], &usb_info[hub], desc) ||
-#endif
-      false) {
-    return;
+  const struct usb_host_id* id = match(hub, 0);
+  if (id) {
+    probe(hub, id);
   }
 }
 
-static uint8_t check_configuration_desc(uint8_t hub, const uint8_t* data) {
-  const struct usb_desc_configuration* desc =
-      (const struct usb_desc_configuration*)data;
-  struct usb_desc_head* head = (struct usb_desc_head*)data;
+static uint8_t check_configuration_desc(
+    uint8_t hub,
+    const struct usb_host_configuration* conf) {
   uint8_t class = usb_info[hub].class;
   uint8_t target_interface = 0xff;
-  for (uint8_t i = head->bLength; i < desc->wTotalLength; i += head->bLength) {
-    head = (struct usb_desc_head*)(data + i);
-    if (target_interface != 0xff &&
-        head->bDescriptorType == USB_DESC_INTERFACE) {
-      break;
-    }
-    switch (head->bDescriptorType) {
-      case USB_DESC_INTERFACE: {
-        const struct usb_desc_interface* intf =
-            (const struct usb_desc_interface*)(data + i);
+  for (uint8_t i = 0; i < conf->interfaces && target_interface == 0xff; ++i) {
+    const struct usb_host_interface* intf = &conf->interface[i];
 #ifdef _DBG_DESC
-        Serial.printf("interface class: %x\n", intf->bInterfaceClass);
-        Serial.printf("interface subclass: %x\n", intf->bInterfaceSubClass);
-        Serial.printf("interface protocol: %x\n", intf->bInterfaceProtocol);
+    Serial.printf("interface class: %x\n", intf->class_code);
+    Serial.printf("interface subclass: %x\n", intf->subclass);
+    Serial.printf("interface protocol: %x\n", intf->protocol);
 #endif  // _DBG_DESC
-        if ((usb_info[hub].class == USB_CLASS_MISC &&
-             usb_info[hub].subclass == USB_MISC_SUBCLASS_IAD &&
-             usb_info[hub].protocol == USB_MISC_PROTOCOL_IAD) ||
-            (usb_info[hub].class == 0)) {
-          class = intf->bInterfaceClass;
-        }
-        if (
-#if !defined(_HID_NO_KEYBOARD)
-            hid_keyboard_check_interface_desc(&hid_info[hub], intf) ||
-#endif
-#if !defined(_HID_NO_MOUSE)
-            hid_mouse_check_interface_desc(&hid_info[hub], &usb_info[hub],
-                                           intf) ||
-#endif
-#if !defined(_HID_NO_XBOX)
-            hid_xbox_check_interface_desc(&hid_info[hub], intf) ||
-#endif
+    if ((usb_info[hub].class == USB_CLASS_MISC &&
+         usb_info[hub].subclass == USB_MISC_SUBCLASS_IAD &&
+         usb_info[hub].protocol == USB_MISC_PROTOCOL_IAD) ||
+        (usb_info[hub].class == 0)) {
+      class = intf->class_code;
+    }
+    const struct usb_host_id* id = match(hub, intf);
+    if (id) {
+      probe(hub, id);
+    }
+    if (id ||
 #if !defined(_HID_NO_GUNCON3)
-            hid_guncon3_check_interface_desc(&hid_info[hub], &usb_info[hub]) ||
+        hid_guncon3_check_interface_desc(&hid_info[hub], &usb_info[hub]) ||
 #endif
-            (intf->bInterfaceClass == USB_CLASS_HID &&
-             intf->bInterfaceSubClass != USB_HID_SUBCLASS_BOOT)) {
-          target_interface = intf->bInterfaceNumber;
-        }
-        break;
-      }
-      case USB_DESC_HID: {
-        const struct usb_desc_hid* hid = (const struct usb_desc_hid*)(data + i);
-        hid_info[hub].report_desc_size = hid->wDescriptorLength;
-        break;
-      }
-      case USB_DESC_ENDPOINT: {
-        if (hid_info[hub].type == HID_TYPE_UNKNOWN && class != USB_CLASS_HID) {
-          break;
-        }
-        const struct usb_desc_endpoint* ep =
-            (const struct usb_desc_endpoint*)(data + i);
-        if (ep->bEndpointAddress >= 128 && (ep->bmAttributes & 3) == 3) {
-          // interrupt input.
-          usb_info[hub].ep_in = ep->bEndpointAddress & 0x0f;
-          usb_info[hub].ep_max_packet_size = ep->wMaxPacketSize;
+        (intf->class_code == USB_CLASS_HID &&
+         intf->subclass != USB_HID_SUBCLASS_BOOT)) {
+      target_interface = intf->number;
+    }
+    if (intf->hid_report_desc_length) {
+      hid_info[hub].report_desc_size = intf->hid_report_desc_length;
+    }
+    if (hid_info[hub].type == HID_TYPE_UNKNOWN && class != USB_CLASS_HID) {
+      continue;
+    }
+    for (uint8_t j = 0; j < intf->endpoints; ++j) {
+      const struct usb_host_endpoint* ep =
+          &conf->endpoint[intf->first_endpoint + j];
+      if (ep->address >= 128 && (ep->attributes & 3) == 3) {
+        // interrupt input.
+        usb_info[hub].ep_in = ep->address & 0x0f;
+        usb_info[hub].ep_max_packet_size = ep->max_packet_size;
 #ifdef _DBG_DESC
-          Serial.printf("ep in: %d\n", usb_info[hub].ep_in);
+        Serial.printf("ep in: %d\n", usb_info[hub].ep_in);
 #endif
-        } else if (ep->bEndpointAddress < 128 && (ep->bmAttributes & 3) == 3) {
-          // interrupt output.
-          usb_info[hub].ep_out = ep->bEndpointAddress & 0x0f;
+      } else if (ep->address < 128 && (ep->attributes & 3) == 3) {
+        // interrupt output.
+        usb_info[hub].ep_out = ep->address & 0x0f;
 #ifdef _DBG_DESC
-          Serial.printf("ep out: %d\n", usb_info[hub].ep_out);
+        Serial.printf("ep out: %d\n", usb_info[hub].ep_out);
 #endif
-        }
-        break;
       }
     }
   }
@@ -184,6 +433,11 @@ static uint8_t check_configuration_desc(uint8_t hub, const uint8_t* data) {
 #endif
   if (hid_info[hub].report_desc_size && usb_info[hub].ep_in) {
     hid_info[hub].state = HID_STATE_NOT_READY;
+    // Known devices restore the HID report descriptor check result.
+    cached[hub] = cache_load(hub, conf);
+    if (cached[hub]) {
+      compile_plan(hub);
+    }
   }
 
 #if !defined(_HID_NO_KEYBOARD) || !defined(_HID_NO_GUNCON3) || \
@@ -199,6 +453,7 @@ static uint8_t check_configuration_desc(uint8_t hub, const uint8_t* data) {
       hid_xbox_initialize(&hid_info[hub], &usb_info[hub]) ||
 #endif
       false) {
+    compile_plan(hub);
     if (hid->detected) {
       hid->detected();
     }
@@ -209,29 +464,59 @@ static uint8_t check_configuration_desc(uint8_t hub, const uint8_t* data) {
 }
 
 #ifdef _DBG_HID_REPORT_DESC
-#define REPORT(s) Serial.printf("Report %s: %x\n", s, data[i])
-#define REPORT0(s) Serial.println(s " (0)")
-#define REPORT1(s) Serial.printf(s " (1): %x\n", data[i + 1])
-#define REPORT2(s) Serial.printf(s " (2): %x%x\n", data[i + 2], data[i + 1])
+#define REPORT(s) Serial.printf(s ": %x\n", (uint16_t)value)
 #else
 #define REPORT(s)
-#define REPORT0(s)
-#define REPORT1(s)
-#define REPORT2(s)
 #pragma disable_warning 110
 #endif
 
-static void check_hid_report_desc(uint8_t hub, const uint8_t* data) {
-  if (hid_info[hub].state != HID_STATE_NOT_READY) {
-    return;
-  }
-#ifdef _DBG_HID_REPORT_DESC_DUMP
-  {
-    for (uint16_t i = 0; i < hid_info[hub].report_desc_size; ++i)
-      Serial.printf("0x%x, ", data[i]);
-  }
-#endif
-  const uint16_t size = hid_info[hub].report_desc_size;
+// Usages with the usage page in the upper 16 bits.
+#define USAGE_X 0x00010030UL
+#define USAGE_Y 0x00010031UL
+#define USAGE_Z 0x00010032UL
+#define USAGE_RZ 0x00010035UL
+#define USAGE_HAT 0x00010039UL
+#define USAGE_PS4_COUNTER 0xff000020UL
+
+// Usages that place an axis regardless of the field order, in the axis order.
+static const uint32_t axis_usages[4] = {USAGE_X, USAGE_Y, USAGE_Z, USAGE_RZ};
+
+// Data bytes of a short item for each bSize.
+static const uint8_t item_data_size[4] = {0, 1, 2, 4};
+
+// Global items that Push and Pop save and restore.
+struct report_globals {
+  uint16_t usage_page;
+  int32_t logical_min;
+  int32_t logical_max;
+  uint8_t report_size;
+  uint16_t report_count;
+  uint8_t report_id;
+};
+
+// The HID report descriptor arrives in pieces. Items are assembled here, and
+// the parser state persists across pieces. Only one descriptor is parsed at a
+// time as the host holds the bus during the transfer.
+struct report_parser {
+  uint8_t item[5];
+  uint8_t item_size;  // collected bytes of `item`
+  uint8_t skip;       // remaining bytes of a long item
+  bool selected;      // hid_info holds a report that looks good
+  struct report_globals globals;
+  struct report_globals stack[HID_REPORT_STACK_DEPTH];
+  uint8_t stack_depth;  // may exceed HID_REPORT_STACK_DEPTH
+  // Local items. Usages are counted rather than kept, and only the ones that
+  // the Input item needs are recorded by their index.
+  uint16_t usages;
+  uint32_t first_usage;
+  uint32_t usage_min;
+  uint32_t axis_usage[4];  // bit n is set if the n-th usage is `axis_usages`
+  uint8_t button_index;
+  uint8_t analog_index;
+};
+static struct report_parser parser;
+
+static void reset_report(uint8_t hub) {
   hid_info[hub].report_size = 0;
   for (uint8_t button = 0; button < 6; ++button) {
     hid_info[hub].axis[button] = 0xffff;
@@ -243,204 +528,270 @@ static void check_hid_report_desc(uint8_t hub, const uint8_t* data) {
   for (uint8_t button = 0; button < 13; ++button) {
     hid_info[hub].button[button] = 0xffff;
   }
+  parser.button_index = 0;
+  parser.analog_index = 0;
+}
+
+static void reset_locals(void) {
+  parser.usages = 0;
+  parser.first_usage = 0;
+  parser.usage_min = 0;
+  for (uint8_t i = 0; i < 4; ++i) {
+    parser.axis_usage[i] = 0;
+  }
+}
+
+static void begin_report_desc(uint8_t hub) {
+  memset(&parser, 0, sizeof(parser));
+  reset_report(hub);
+  reset_locals();
   hid_info[hub].report_id = 0;
-  uint8_t report_size = 0;
-  uint8_t report_count = 0;
-  uint16_t usage_page = 0;
-  uint8_t usage_index = 0;
-  uint32_t usages[12];
-  uint8_t button_index = 0;
-  for (usage_index = 0; usage_index < 12; ++usage_index) {
-    usages[usage_index] = 0;
-  }
-  usage_index = 0;
-  uint8_t analog_index = 0;
-  for (uint16_t i = 0; i < size;) {
-    // Long items are not supported
-    if (data[i] == 0xfe) {
-      if ((i + 1) < size) {
-        i += data[i + 1] + 3;
-        continue;
-      } else {
-        break;  // for
+}
+
+static bool looks_good(const struct hid_info* info) {
+  return info->report_size &&
+         (info->hat != 0xffff || info->dpad[3] != 0xffff ||
+          info->axis[1] != 0xffff) &&
+         info->button[1] != 0xffff;
+}
+
+// Adds usages from `first` to `last` to the local state.
+static void add_usages(uint32_t first, uint32_t last) {
+  if (!parser.usages) {
+    parser.first_usage = first;
+  }
+  for (uint8_t i = 0; i < 4; ++i) {
+    const uint32_t usage = axis_usages[i];
+    if (first <= usage && usage <= last) {
+      const uint32_t index = parser.usages + (usage - first);
+      if (index < 32) {
+        parser.axis_usage[i] |= (uint32_t)1 << index;
       }
     }
-    // Short items
-    uint8_t b_size = data[i] & 3;
-    if (b_size == 0) {  // 0 byte items
-      switch (data[i]) {
-        case 0xc0:
-          REPORT0("M:End Collection");
-          for (usage_index = 0; usage_index < 12; ++usage_index) {
-            usages[usage_index] = 0;
-          }
-          usage_index = 0;
-          break;
-        default:  // ignore
-          REPORT("Skip 0");
-          break;
+  }
+  parser.usages += (uint16_t)(last - first) + 1;
+}
+
+// Aligns the logical range of an axis, rather than its field, to 16 bits.
+static void set_axis_range(struct hid_info* info, uint8_t axis, uint8_t size) {
+  const int32_t min = parser.globals.logical_min;
+  const int32_t max = parser.globals.logical_max;
+  uint8_t bits = size;
+  if (min < max) {
+    const uint32_t span = (uint32_t)(max - min);
+    for (bits = 1; bits < size && (span >> bits); ++bits)
+      ;
+  }
+  info->axis_size[axis] = size;
+  info->axis_shift[axis] = size - bits;
+  info->axis_sign[axis] = min < 0;
+  info->axis_polarity[axis] = false;
+}
+
+static void parse_input(uint8_t hub, uint8_t flags) {
+  struct hid_info* info = &hid_info[hub];
+  const uint8_t report_size = parser.globals.report_size;
+  const uint16_t report_count = parser.globals.report_count;
+  if (parser.globals.report_id != info->report_id) {
+    return;  // Not the report that hid_info holds.
+  }
+  if (flags & 1) {
+    // Skip constant
+  } else if (parser.first_usage == USAGE_HAT && report_size == 4) {
+    info->hat = info->report_size;
+  } else if (parser.first_usage == USAGE_PS4_COUNTER && report_size == 6) {
+    info->type = HID_TYPE_PS4;
+  } else if (report_size == 1) {  // Buttons
+    for (uint16_t i = 0; i < report_count && parser.button_index < 13; ++i) {
+      info->button[parser.button_index++] = info->report_size + i;
+    }
+  } else {  // Analog buttons
+    uint8_t analog_index = parser.analog_index;
+    for (uint16_t i = 0; i < report_count && analog_index < 6; ++i) {
+      for (uint8_t axis = 0; i < 32 && axis < 4; ++axis) {
+        if (parser.axis_usage[axis] & ((uint32_t)1 << i)) {
+          analog_index = axis;
+        }
       }
-      i++;
-    } else if (b_size == 1) {  // 1 bytes items
-      if ((i + 1) >= size) {
-        break;  // for
+      set_axis_range(info, analog_index, report_size);
+      info->axis[analog_index++] = info->report_size + report_size * i;
+      while (analog_index < 6 && info->axis[analog_index] != 0xffff) {
+        analog_index++;
       }
-      switch (data[i]) {
-        case 0x05:
-          REPORT1("G:Usage Page");
-          usage_page = data[i + 1];
-          break;
-        case 0x09:
-          REPORT1("L:Usage");
-          if (usage_index < 12) {
-            usages[usage_index++] = ((uint32_t)usage_page << 16) | data[i + 1];
-          }
-          break;
-        case 0x15:
-          REPORT1("G:Logical Minimum");
-          break;
-        case 0x19:
-          REPORT1("L:Usage Minimum");
-          break;
-        case 0x25:
-          REPORT1("G:Logical Maximum");
-          break;
-        case 0x29:
-          REPORT1("L:Usage Maxmum");
-          break;
-        case 0x35:
-          REPORT1("G:Physical Minimum");
-          break;
-        case 0x65:
-          REPORT1("G:Unit");
-          break;
-        case 0x75:
-          REPORT1("G:Report Size");
-          report_size = data[i + 1];
-          break;
-        case 0x81:
-          REPORT1("M:Input");
-          if (data[i + 1] & 1) {
-            // Skip constant
-          } else if (usages[0] == 0x00010039 && report_size == 4 &&
-                     (data[i + 1] & 1) == 0) {  // Hat switch
-            hid_info[hub].hat = hid_info[hub].report_size;
-          } else if (usages[0] == 0xff000020 && report_size == 6) {
-            // PS4 counter
-            hid_info[hub].type = HID_TYPE_PS4;
-          } else if (report_size == 1) {  // Buttons
-            for (uint8_t i = 0; i < report_count && button_index < 13; ++i) {
-              hid_info[hub].button[button_index++] =
-                  hid_info[hub].report_size + i;
-            }
-          } else if ((data[i + 1] & 1) == 0) {  // Analog buttons
-            for (uint8_t i = 0; i < report_count && analog_index < 6; ++i) {
-              if (usages[i] == 0x00010030) {
-                analog_index = 0;
-              } else if (usages[i] == 0x00010031) {
-                analog_index = 1;
-              } else if (usages[i] == 0x00010032) {
-                analog_index = 2;
-              } else if (usages[i] == 0x00010035) {
-                analog_index = 3;
-              }
-              hid_info[hub].axis_size[analog_index] = report_size;
-              hid_info[hub].axis_shift[analog_index] = 0;
-              hid_info[hub].axis_sign[analog_index] = false;
-              hid_info[hub].axis_polarity[analog_index] = false;
-              hid_info[hub].axis[analog_index++] =
-                  hid_info[hub].report_size + report_size * i;
-              while (analog_index < 6 &&
-                     hid_info[hub].axis[analog_index] != 0xffff) {
-                analog_index++;
-              }
-            }
-          }
-          usage_index = 0;
-          hid_info[hub].report_size += report_size * report_count;
-          break;
-        case 0x85:
-          if (hid_info[hub].report_size &&
-              (hid_info[hub].hat != 0xffff || hid_info[hub].dpad[3] != 0xffff ||
-               hid_info[hub].axis[1] != 0xffff) &&
-              hid_info[hub].button[1] != 0xffff) {
-            goto quit;
-          }
-          hid_info[hub].report_size = 0;
-          for (uint8_t button = 0; button < 6; ++button) {
-            hid_info[hub].axis[button] = 0xffff;
-          }
-          hid_info[hub].hat = 0xffff;
-          for (uint8_t button = 0; button < 4; ++button) {
-            hid_info[hub].dpad[button] = 0xffff;
-          }
-          for (uint8_t button = 0; button < 13; ++button) {
-            hid_info[hub].button[button] = 0xffff;
-          }
-          for (uint8_t button = 0; button < 12; ++button) {
-            usages[button] = 0;
-          }
-          usage_index = 0;
-          button_index = 0;
-          analog_index = 0;
-          REPORT1("G:Report ID");
-          hid_info[hub].report_id = data[i + 1];
-          break;
-        case 0x95:
-          REPORT1("G:Report Count");
-          report_count = data[i + 1];
-          break;
-        case 0xa1:
-          REPORT1("M:Collection");
-          for (usage_index = 0; usage_index < 12; ++usage_index) {
-            usages[usage_index] = 0;
-          }
-          usage_index = 0;
-          break;
-        default:  // not supported
-          REPORT("Skip 1");
-          break;
+    }
+    parser.analog_index = analog_index;
+  }
+  info->report_size += report_size * report_count;
+}
+
+static void parse_report_id(uint8_t hub, uint8_t report_id) {
+  parser.globals.report_id = report_id;
+  if (parser.selected || report_id == hid_info[hub].report_id) {
+    return;
+  }
+  // Takes the first report that looks good, or the last one.
+  if (looks_good(&hid_info[hub])) {
+    parser.selected = true;
+    return;
+  }
+  reset_report(hub);
+  hid_info[hub].report_id = report_id;
+}
+
+// Handles a complete short item.
+static void parse_item(uint8_t hub, const uint8_t* item) {
+  const uint8_t size = item_data_size[item[0] & 3];
+  uint32_t value = 0;
+  for (uint8_t i = size; i; --i) {
+    value = (value << 8) | item[i];
+  }
+  // Sign extended value for items that can be negative.
+  int32_t svalue = value;
+  if (size && size < 4 && (item[size] & 0x80)) {
+    svalue -= (int32_t)1 << (size * 8);
+  }
+  switch (item[0] & 0xfc) {
+    // Main items
+    case 0x80:
+      REPORT("M:Input");
+      parse_input(hub, value);
+      reset_locals();
+      break;
+    case 0x90:
+      REPORT("M:Output");
+      reset_locals();
+      break;
+    case 0xb0:
+      REPORT("M:Feature");
+      reset_locals();
+      break;
+    case 0xa0:
+      REPORT("M:Collection");
+      reset_locals();
+      break;
+    case 0xc0:
+      REPORT("M:End Collection");
+      reset_locals();
+      break;
+    // Global items
+    case 0x04:
+      REPORT("G:Usage Page");
+      parser.globals.usage_page = value;
+      break;
+    case 0x14:
+      REPORT("G:Logical Minimum");
+      parser.globals.logical_min = svalue;
+      break;
+    case 0x24:
+      REPORT("G:Logical Maximum");
+      // Common descriptors declare 255 as 0xff for unsigned values.
+      parser.globals.logical_max =
+          (parser.globals.logical_min < 0) ? svalue : (int32_t)value;
+      break;
+    case 0x74:
+      REPORT("G:Report Size");
+      parser.globals.report_size = value;
+      break;
+    case 0x84:
+      REPORT("G:Report ID");
+      parse_report_id(hub, value);
+      break;
+    case 0x94:
+      REPORT("G:Report Count");
+      parser.globals.report_count = value;
+      break;
+    case 0xa4:
+      REPORT("G:Push");
+      if (parser.stack_depth < HID_REPORT_STACK_DEPTH) {
+        parser.stack[parser.stack_depth] = parser.globals;
       }
-      i += 2;
-    } else if (b_size == 2) {
-      // 2 bytes items
-      if ((i + 2) >= size) {
+      parser.stack_depth++;
+      break;
+    case 0xb4:
+      REPORT("G:Pop");
+      if (!parser.stack_depth) {
         break;
       }
-      switch (data[i]) {
-        case 0x06:
-          REPORT2("G:Usage Page");
-          usage_page = (data[i + 2] << 8) | data[i + 1];
-          break;
-        case 0x0a:
-          REPORT2("L:Usage");
-          if (usage_index < 12) {
-            usages[usage_index++] =
-                ((uint32_t)usage_page << 16) | (data[i + 2] << 8) | data[i + 1];
-          }
-          break;
-        case 0x16:
-          REPORT2("G:Logical Minimum");
-          break;
-        case 0x26:
-          REPORT2("G:Logical Maximum");
-          break;
-        case 0x36:
-          REPORT2("G:Physical Minimum");
-          break;
-        case 0x46:
-          REPORT2("G:Physical Maximum");
-          break;
-        default:  // not supported
-          REPORT("Skip 2");
-          break;
+      parser.stack_depth--;
+      if (parser.stack_depth < HID_REPORT_STACK_DEPTH) {
+        parser.globals = parser.stack[parser.stack_depth];
+      }
+      break;
+    // Local items
+    case 0x08:
+      REPORT("L:Usage");
+      if (size < 4) {
+        value |= (uint32_t)parser.globals.usage_page << 16;
+      }
+      add_usages(value, value);
+      break;
+    case 0x18:
+      REPORT("L:Usage Minimum");
+      if (size < 4) {
+        value |= (uint32_t)parser.globals.usage_page << 16;
       }
-      i += 3;
-    } else {  // 4 bytes items
-      i += 5;
+      parser.usage_min = value;
+      break;
+    case 0x28:
+      REPORT("L:Usage Maximum");
+      if (size < 4) {
+        value |= (uint32_t)parser.globals.usage_page << 16;
+      }
+      if (parser.usage_min <= value) {
+        add_usages(parser.usage_min, value);
+      }
+      break;
+    default:
+      // Physical ranges, units, designators, strings, and delimiters do not
+      // affect how fields are extracted.
+      REPORT("Skip");
+      break;
+  }
+}
+
+static void parse_report_desc(uint8_t hub, const uint8_t* data, uint8_t size) {
+  for (uint8_t i = 0; i < size; ++i) {
+    if (parser.skip) {
+      parser.skip--;
+      continue;
     }
+    parser.item[parser.item_size++] = data[i];
+    if (parser.item[0] == 0xfe) {
+      // Long items are not supported
+      if (parser.item_size == 2) {
+        parser.skip = parser.item[1] + 1;
+        parser.item_size = 0;
+      }
+      continue;
+    }
+    // Short items
+    if (parser.item_size == item_data_size[parser.item[0] & 3] + 1) {
+      parse_item(hub, parser.item);
+      parser.item_size = 0;
+    }
+  }
+}
+
+static void check_hid_report_desc(uint8_t hub,
+                                  uint16_t offset,
+                                  const uint8_t* data,
+                                  uint8_t size) {
+  if (hid_info[hub].state != HID_STATE_NOT_READY) {
+    return;
+  }
+  if (!offset) {
+    begin_report_desc(hub);
+  }
+#ifdef _DBG_HID_REPORT_DESC_DUMP
+  {
+    for (uint8_t i = 0; i < size; ++i)
+      Serial.printf("0x%x, ", data[i]);
+  }
+#endif
+  if (size) {
+    parse_report_desc(hub, data, size);
+    return;
   }
-quit:
 #ifdef _DBG_HID_REPORT_DESC
   Serial.printf("Report Size for ID (%d): %d-bits (%d-Bytes)\n",
                 hid_info[hub].report_id, hid_info[hub].report_size,
@@ -518,6 +869,8 @@ quit:
     usb_info[hub].get_report_value = 0x0303;
     usb_info[hub].get_report_length = 0x30;
   }
+  compile_plan(hub);
+  cache_store(hub);
 }
 
 static void hid_report(uint8_t hub, uint8_t* data, uint16_t size) {
@@ -541,6 +894,14 @@ static void hid_report(uint8_t hub, uint8_t* data, uint16_t size) {
     return;
   }
 #endif
+  if (hid->on_change && size) {
+    struct hid_gamepad_state state;
+    // Clears padding that memcmp() sees.
+    memset(&state, 0, sizeof(state));
+    if (hid_decode(hub, data, size, &state)) {
+      update_gamepad(hub, &state);
+    }
+  }
   if (hid->report && size) {
     hid->report(hub, &hid_info[hub], data, size);
   }
@@ -549,6 +910,43 @@ static void hid_report(uint8_t hub, uint8_t* data, uint16_t size) {
   }
 }
 
+static void in_complete(uint8_t hub,
+                        void* context,
+                        uint8_t result,
+                        uint8_t* data,
+                        uint16_t size) {
+  context;
+  in_pending[hub] = false;
+  if (result == USB_HOST_RESULT_DISCONNECTED) {
+    return;
+  }
+  hid_report(hub, data, size);
+}
+
+static void submit_in(uint8_t hub, uint16_t size) {
+  if (in_pending[hub]) {
+    return;
+  }
+  in_request[hub].type = USB_HOST_REQ_IN;
+  in_request[hub].ep = usb_info[hub].ep_in;
+  in_request[hub].size = size;
+  in_request[hub].data = (size <= 64) ? report_buffer[hub] : 0;
+  in_request[hub].complete = in_complete;
+  in_pending[hub] = usb_host_submit(hub, &in_request[hub]);
+}
+
+static bool uses_request_queue(uint8_t type) {
+  switch (type) {
+    case HID_TYPE_ZAPPER:
+    case HID_TYPE_PS3:
+    case HID_TYPE_XBOX_360:
+    case HID_TYPE_XBOX_ONE:
+    case HID_TYPE_SWITCH:
+      return false;
+  }
+  return true;
+}
+
 void hid_init(struct hid* new_hid) {
   hid = new_hid;
   if (hid->get_flags) {
@@ -558,14 +956,22 @@ void hid_init(struct hid* new_hid) {
   }
   if (!hid->detected)
     hid->detected = do_nothing;
+  host.timing = hid->timing;
 
   host.disconnected = disconnected;
   host.check_device_desc = check_device_desc;
   host.check_string_desc = 0;
   host.check_configuration_desc = check_configuration_desc;
   host.check_hid_report_desc = check_hid_report_desc;
+  host.is_cached = is_cached;
   host.in = hid_report;
   host.hid_report = hid_report;
+  host.frame = hid->frame;
+  for (uint8_t hub = 0; hub < USB_HOST_MAX_DEVICES; ++hub) {
+    report_buffer[hub] = _report_buffer[hub];
+    if ((uintptr_t)report_buffer[hub] & 1)
+      report_buffer[hub]++;
+  }
   usb_host_init(&host);
 }
 
@@ -573,25 +979,77 @@ struct hid_info* hid_get_info(uint8_t hub) {
   return &hid_info[hub];
 }
 
-void hid_poll(void) {
-  static uint8_t next_hub = 0;
-  usb_host_poll();
-  if (!usb_host_idle()) {
-    return;
+const struct hid_gamepad_state* hid_get_gamepad_state(uint8_t hub) {
+  return &gamepad[hub];
+}
+
+bool hid_decode(uint8_t hub,
+                const uint8_t* data,
+                uint16_t size,
+                struct hid_gamepad_state* state) {
+  const struct plan* p = &plan[hub];
+  if (p->report_id) {
+    if (!size || data[0] != p->report_id)
+      return false;
+    data++;
+    size--;
+  }
+  if (size < p->size)
+    return false;
+  uint16_t buttons = 0;
+  for (uint8_t i = 0; i < 13; ++i) {
+    if (data[p->button[i].index] & p->button[i].mask)
+      buttons |= 1 << i;
+  }
+  state->buttons = buttons;
+  uint8_t dpad = 0;
+  for (uint8_t i = 0; i < 4; ++i) {
+    if (data[p->dpad[i].index] & p->dpad[i].mask)
+      dpad |= 1 << i;
+  }
+  if (p->hat.bytes)
+    dpad |= hat_dpad[read_field(data, &p->hat)];
+  state->dpad = dpad;
+  for (uint8_t i = 0; i < 6; ++i) {
+    const struct field* f = &p->axis[i];
+    state->axis[i] =
+        f->bytes ? (int16_t)((read_field(data, f) << f->scale) ^ f->flip) : 0;
+  }
+  return true;
+}
+
+// Returns false if the device has nothing to do now.
+static bool poll_device(uint8_t hub) {
+  if (hid_info[hub].state == HID_STATE_DISCONNECTED) {
+    return false;
   }
-  uint8_t hub = next_hub;
-  next_hub = (next_hub + 1) & 1;
   uint16_t wait = usb_info[hub].wait;
   if (wait) {
     uint16_t begin = usb_info[hub].tick;
     if (timer3_tick_raw_between(begin, begin + wait)) {
-      return;
+      return false;
     }
   }
-  if (!usb_host_ready(hub)) {
-    return;
+  if (in_pending[hub]) {
+    return false;
   }
-  if (hid_info[hub].state == HID_STATE_READY) {
+  if ((!usb_host_idle() || !usb_host_ready(hub)) &&
+      (hid_info[hub].state != HID_STATE_READY ||
+       !uses_request_queue(hid_info[hub].type))) {
+    // Queued requests do not need to wait for the bus to be idle.
+    return false;
+  }
+  if (hid_info[hub].state == HID_STATE_NOT_READY) {
+    if (!cached[hub]) {
+      return false;
+    }
+    // The restored layout takes effect as the enumeration has finished.
+    hid_info[hub].state = usb_info[hub].get_report_value ? HID_STATE_SET_IDLE
+                                                         : HID_STATE_READY;
+    if (hid_info[hub].type != HID_TYPE_UNKNOWN && hid->detected) {
+      hid->detected();
+    }
+  } else if (hid_info[hub].state == HID_STATE_READY) {
     switch (hid_info[hub].type) {
 #if !defined(_HID_NO_GUNCON3)
       case HID_TYPE_ZAPPER:
@@ -621,7 +1079,8 @@ void hid_poll(void) {
         if (hid_info[hub].report_id) {
           size++;
         }
-        usb_host_in(hub, usb_info[hub].ep_in, size);
+        // Queued so that the host can issue it as soon as the bus gets free.
+        submit_in(hub, size);
         break;
       }
     } /* switch */
@@ -630,8 +1089,8 @@ void hid_poll(void) {
         USB_REQ_DIR_OUT | USB_REQ_TYPE_CLASS | USB_REQ_RECPT_INTERFACE,
         USB_HID_SET_IDLE, 0, 0, 0};
     set_idle.wIndex = usb_info[hub].interface;
-    usb_host_setup(hub, &set_idle, 0);
-    hid_info[hub].state = HID_STATE_GET_REPORT;
+    if (usb_host_setup(hub, &set_idle, 0))
+      hid_info[hub].state = HID_STATE_GET_REPORT;
   } else if (hid_info[hub].state == HID_STATE_GET_REPORT) {
     static struct usb_setup_req get_report = {
         USB_REQ_DIR_IN | USB_REQ_TYPE_CLASS | USB_REQ_RECPT_INTERFACE,
@@ -639,7 +1098,21 @@ void hid_poll(void) {
     get_report.wIndex = usb_info[hub].interface;
     get_report.wValue = usb_info[hub].get_report_value;
     get_report.wLength = usb_info[hub].get_report_length;
-    usb_host_setup(hub, &get_report, 0);
-    hid_info[hub].state = HID_STATE_READY;
+    if (usb_host_setup(hub, &get_report, 0))
+      hid_info[hub].state = HID_STATE_READY;
+  }
+  return true;
+}
+
+void hid_poll(void) {
+  static uint8_t next_hub = 0;
+  usb_host_poll();
+  // Devices that have nothing to do pass their turn to the next one.
+  for (uint8_t i = 0; i < USB_HOST_MAX_DEVICES; ++i) {
+    uint8_t hub = next_hub;
+    next_hub = (next_hub + 1) % USB_HOST_MAX_DEVICES;
+    if (poll_device(hub)) {
+      return;
+    }
   }
 }
\ No newline at end of file
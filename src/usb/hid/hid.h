@@ -49,6 +49,25 @@ enum {
   HID_BUTTON_META,
 };
 
+enum {
+  HID_DPAD_UP = 1 << 0,
+  HID_DPAD_DOWN = 1 << 1,
+  HID_DPAD_LEFT = 1 << 2,
+  HID_DPAD_RIGHT = 1 << 3,
+};
+
+// Push items that the report descriptor parser can nest. Globals pushed deeper
+// are not restored.
+#ifndef HID_REPORT_STACK_DEPTH
+#define HID_REPORT_STACK_DEPTH 2
+#endif
+
+// Field positions are bit offsets in the report following the report ID, or
+// 0xffff if not available. An axis value of `axis_size` bits is aligned to 16
+// bits and shifted left by `axis_shift` so that the full range spans 16 bits,
+// e.g. 6 for 10-bit Xbox One triggers, not 5 as before. `axis_sign` is set for
+// signed values, and `axis_polarity` inverts them. `dpad` is in the HID_DPAD_*
+// order.
 struct hid_info {
   uint16_t report_desc_size;
   uint16_t report_size;
@@ -65,6 +84,27 @@ struct hid_info {
   uint8_t state;
 };
 
+// A report decoded by hid_decode().
+struct hid_gamepad_state {
+  uint16_t buttons;  // bit n is set if HID_BUTTON_n is pressed
+  uint8_t dpad;      // HID_DPAD_* bits, including the hat switch
+  int16_t axis[6];   // 16-bit signed values centered at 0
+};
+
+// An enumeration result stored in the data flash. Apps should reserve
+// `sizeof(struct hid_cache_entry) * cache_entries` bytes at `cache_offset`.
+struct hid_cache_entry {
+  uint8_t version;
+  uint16_t vid;
+  uint16_t pid;
+  uint16_t device;
+  uint16_t configuration_size;
+  uint16_t configuration_hash;
+  uint16_t get_report_value;
+  uint8_t get_report_length;
+  struct hid_info hid_info;
+};
+
 struct hid {
   void (*report)(uint8_t hub,
                  const struct hid_info* hid_info,
@@ -73,10 +113,35 @@ struct hid {
   void (*detected)(void);
 
   uint8_t (*get_flags)(void);
+
+  // Enumeration timing passed to usb_host. Optional.
+  const struct usb_host_timing* timing;
+
+  // Data flash area to cache enumeration results. The cache is disabled if
+  // `cache_entries` is 0. The flash should be initialized by flash_init().
+  uint16_t cache_offset;
+  uint8_t cache_entries;
+
+  // Called from hid_poll() once per 1ms USB frame in a fixed phase to SOF.
+  // Optional.
+  void (*frame)(uint16_t frame);
+
+  // Called with a report decoded by hid_decode() only if it differs from the
+  // last one, and with a neutral state on disconnection. Optional.
+  void (*on_change)(uint8_t hub, const struct hid_gamepad_state* state);
 };
 
 void hid_init(struct hid* hid);
 struct hid_info* hid_get_info(uint8_t hub);
+// Decodes a report that `report` receives into `state` with an extraction plan
+// compiled from hid_info when the device gets ready. Returns false if the
+// report is for another report ID, or too short.
+bool hid_decode(uint8_t hub,
+                const uint8_t* data,
+                uint16_t size,
+                struct hid_gamepad_state* state);
+// Returns the last state that `on_change` reported.
+const struct hid_gamepad_state* hid_get_gamepad_state(uint8_t hub);
 void hid_poll(void);
 
 #endif  // __hid_h__
@@ -25,15 +25,8 @@ enum {
   DEVICE_READY,
 };
 
-bool hid_dualshock3_check_device_desc(struct hid_info* hid_info,
-                                      struct usb_info* usb_info,
-                                      const struct usb_desc_device* desc) {
-  if (desc->idVendor == 0x054c && desc->idProduct == 0x0268) {
-    hid_info->type = HID_TYPE_PS3;
-    usb_info->state = DEVICE_CONNECTED;
-    return true;
-  }
-  return false;
+void hid_dualshock3_probe(struct usb_info* usb_info) {
+  usb_info->state = DEVICE_CONNECTED;
 }
 
 void hid_dualshock3_initialize(struct hid_info* hid_info) {
@@ -102,17 +95,17 @@ void hid_dualshock3_poll(uint8_t hub,
                          struct hid_info* hid_info,
                          struct usb_info* usb_info) {
   if (usb_info->state == DEVICE_CONNECTED) {
-    usb_host_setup(hub, &hid_set_idle_descriptor, 0);
-    usb_info->state = DEVICE_IDLE;
+    if (usb_host_setup(hub, &hid_set_idle_descriptor, 0))
+      usb_info->state = DEVICE_IDLE;
   } else if (usb_info->state == DEVICE_IDLE) {
-    usb_host_hid_get_report(hub, 3, hid_info->report_id, 64);
-    usb_info->state = DEVICE_GET_REPORT_01;
+    if (usb_host_hid_get_report(hub, 3, hid_info->report_id, 64))
+      usb_info->state = DEVICE_GET_REPORT_01;
   } else if (usb_info->state == DEVICE_GET_REPORT_01) {
-    usb_host_hid_get_report(hub, 3, 0xf2, 64);
-    usb_info->state = DEVICE_GET_REPORT_F2;
+    if (usb_host_hid_get_report(hub, 3, 0xf2, 64))
+      usb_info->state = DEVICE_GET_REPORT_F2;
   } else if (usb_info->state == DEVICE_GET_REPORT_F2) {
-    usb_host_hid_get_report(hub, 3, 0xf5, 64);
-    usb_info->state = DEVICE_GET_REPORT_F5;
+    if (usb_host_hid_get_report(hub, 3, 0xf5, 64))
+      usb_info->state = DEVICE_GET_REPORT_F5;
   } else if (usb_info->state == DEVICE_GET_REPORT_F5) {
     usb_info->state = DEVICE_READY;
   } else if (usb_info->state == DEVICE_READY) {
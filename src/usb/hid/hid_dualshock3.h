@@ -9,12 +9,9 @@
 #include <stdint.h>
 
 struct hid_info;
-struct usb_desc_device;
 struct usb_info;
 
-bool hid_dualshock3_check_device_desc(struct hid_info* hid_info,
-                                      struct usb_info* usb_info,
-                                      const struct usb_desc_device* desc);
+void hid_dualshock3_probe(struct usb_info* usb_info);
 
 void hid_dualshock3_initialize(struct hid_info* hid_info);
 
@@ -79,20 +79,11 @@ void decode(uint8_t* data) {
   }
 }
 
-bool hid_guncon3_check_device_desc(struct hid_info* hid_info,
-                                   struct usb_info* usb_info,
-                                   const struct usb_desc_device* desc) {
-  if (desc->idVendor == 0x0c12 && desc->idProduct == 0x8801) {
-    hid_info->type = HID_TYPE_ZAPPER;
-    usb_info->state = HUB_CONNECTED;
-    return true;
-  }
-  if (desc->idVendor == 0x0b9a && desc->idProduct == 0x0800) {
-    hid_info->type = HID_TYPE_ZAPPER;
-    usb_info->state = DEVICE_CONNECTED;
-    return true;
-  }
-  return false;
+void hid_guncon3_probe(struct usb_info* usb_info,
+                       const struct usb_host_id* id) {
+  // The built-in hub is matched only if usb_host does not handle hubs. Then,
+  // the gun is reached via usb_host_hub_switch().
+  usb_info->state = (id->vid == 0x0c12) ? HUB_CONNECTED : DEVICE_CONNECTED;
 }
 
 bool hid_guncon3_check_interface_desc(struct hid_info* hid_info,
@@ -201,16 +192,16 @@ void hid_guncon3_poll(uint8_t hub, struct usb_info* usb_info) {
 
   switch (usb_info->state) {
     case HUB_CONNECTED: {
-      usb_host_setup(hub, &get_port_status, 0);
-      usb_info->state = HUB_GET_PORT_STATUS;
+      if (usb_host_setup(hub, &get_port_status, 0))
+        usb_info->state = HUB_GET_PORT_STATUS;
       break;
     }
     case HUB_PORT_RESET: {
       static const struct usb_setup_req set_port_reset_feature = {
           USB_REQ_DIR_OUT | USB_REQ_TYPE_CLASS | USB_REQ_RECPT_OTHER,
           USB_SET_FEATURE, USB_FEATURE_PORT_RESET, 0x0001, 0x0000};
-      usb_host_setup(hub, &set_port_reset_feature, 0);
-      usb_info->state = HUB_PORT_RESET_WAIT;
+      if (usb_host_setup(hub, &set_port_reset_feature, 0))
+        usb_info->state = HUB_PORT_RESET_WAIT;
       break;
     }
     case HUB_PORT_RESET_WAIT: {
@@ -222,8 +213,8 @@ void hid_guncon3_poll(uint8_t hub, struct usb_info* usb_info) {
       static const struct usb_setup_req clear_port_reset_feature = {
           USB_REQ_DIR_OUT | USB_REQ_TYPE_CLASS | USB_REQ_RECPT_OTHER,
           USB_CLEAR_FEATURE, USB_FEATURE_C_PORT_RESET, 0x0001, 0x0000};
-      usb_host_setup(hub, &clear_port_reset_feature, 0);
-      usb_info->state = HUB_PORT_SET_ADDRESS;
+      if (usb_host_setup(hub, &clear_port_reset_feature, 0))
+        usb_info->state = HUB_PORT_SET_ADDRESS;
       break;
     }
     case HUB_PORT_SET_ADDRESS:
@@ -231,8 +222,8 @@ void hid_guncon3_poll(uint8_t hub, struct usb_info* usb_info) {
       usb_info->state = HUB_PORT_SET_ADDRESS_DONE;
       break;
     case DEVICE_CONNECTED:
-      usb_host_out(hub, 2, key, 8);
-      usb_info->state = DEVICE_READY;
+      if (usb_host_out(hub, 2, key, 8))
+        usb_info->state = DEVICE_READY;
       break;
     case DEVICE_READY:
       usb_host_in(hub, 2, 15);
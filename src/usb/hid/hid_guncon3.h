@@ -10,12 +10,10 @@
 
 struct hid_info;
 struct usb_info;
-struct usb_desc_device;
-struct usb_desc_interface;
+struct usb_host_id;
 
-bool hid_guncon3_check_device_desc(struct hid_info* hid_info,
-                                   struct usb_info* usb_info,
-                                   const struct usb_desc_device* desc);
+void hid_guncon3_probe(struct usb_info* usb_info,
+                       const struct usb_host_id* id);
 
 bool hid_guncon3_check_interface_desc(struct hid_info* hid_info,
                                       struct usb_info* usb_info);
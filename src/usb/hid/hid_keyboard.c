@@ -4,35 +4,8 @@
 
 #include "hid_keyboard.h"
 
-#include "../usb.h"
 #include "hid.h"
 
-static bool check(uint8_t any_class,
-                  uint8_t any_subclass,
-                  uint8_t any_protocol) {
-  return any_class == USB_CLASS_HID && any_subclass == USB_HID_SUBCLASS_BOOT &&
-         any_protocol == USB_HID_PROTOCOL_KEYBOARD;
-}
-
-bool hid_keyboard_check_device_desc(struct hid_info* hid_info,
-                                    const struct usb_desc_device* desc) {
-  if (check(desc->bDeviceClass, desc->bDeviceSubClass, desc->bDeviceProtocol)) {
-    hid_info->type = HID_TYPE_KEYBOARD;
-    return true;
-  }
-  return false;
-}
-
-bool hid_keyboard_check_interface_desc(struct hid_info* hid_info,
-                                       const struct usb_desc_interface* desc) {
-  if (check(desc->bInterfaceClass, desc->bInterfaceSubClass,
-            desc->bInterfaceProtocol)) {
-    hid_info->type = HID_TYPE_KEYBOARD;
-    return true;
-  }
-  return false;
-}
-
 bool hid_keyboard_initialize(struct hid_info* hid_info) {
   if (hid_info->type != HID_TYPE_KEYBOARD)
     return false;
@@ -8,14 +8,6 @@
 #include <stdbool.h>
 
 struct hid_info;
-struct usb_desc_device;
-struct usb_desc_interface;
-
-bool hid_keyboard_check_device_desc(struct hid_info* hid_info,
-                                    const struct usb_desc_device* desc);
-
-bool hid_keyboard_check_interface_desc(struct hid_info* hid_info,
-                                       const struct usb_desc_interface* desc);
 
 bool hid_keyboard_initialize(struct hid_info* hid_info);
 
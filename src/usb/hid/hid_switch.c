@@ -44,7 +44,7 @@ static struct {
   uint8_t joycon;
   uint8_t data3;
   uint8_t data4;
-} switch_info[2];
+} switch_info[USB_HOST_MAX_DEVICES];
 
 static uint8_t* create_sub_command(struct usb_info* usb_info,
                                    uint8_t sub_command,
@@ -70,18 +70,8 @@ static uint8_t* create_sub_command(struct usb_info* usb_info,
   return cmd;
 }
 
-bool hid_switch_check_device_desc(struct hid_info* hid_info,
-                                  struct usb_info* usb_info,
-                                  const struct usb_desc_device* desc) {
-  if (desc->idVendor == 0x057e) {
-    if (desc->idProduct == 0x2009 || desc->idProduct == 0x200e) {
-      // Nintendo Switch Pro Controller, and Charging Grip.
-      hid_info->type = HID_TYPE_SWITCH;
-      usb_info->state = CONNECTED;
-      return true;
-    }
-  }
-  return false;
+void hid_switch_probe(struct usb_info* usb_info) {
+  usb_info->state = CONNECTED;
 }
 
 bool hid_switch_initialize(struct hid_info* hid_info) {
@@ -209,6 +199,10 @@ retry:
 
 void hid_switch_poll(uint8_t hub, struct usb_info* usb_info) {
   uint8_t ep = switch_info[hub].joycon == 0 ? 1 : 2;
+  // OUT transfers may be refused while other devices need the bus, and IN
+  // transfers until the endpoint interval passes. They are sent again in the
+  // next poll.
+  bool sent = true;
   switch (usb_info->state) {
     case CONNECTED:
       switch_info[hub].joycon = 0;
@@ -217,44 +211,47 @@ void hid_switch_poll(uint8_t hub, struct usb_info* usb_info) {
       break;
     case REQUEST_MAC: {
       static uint8_t request_mac[2] = {0x80, 0x01};
-      usb_host_out(hub, ep, request_mac, sizeof(request_mac));
+      sent = usb_host_out(hub, ep, request_mac, sizeof(request_mac));
       break;
     }
     case HANDSHAKE:
     case HANDSHAKE2: {
       static uint8_t handshake[2] = {0x80, 0x02};
-      usb_host_out(hub, ep, handshake, sizeof(handshake));
+      sent = usb_host_out(hub, ep, handshake, sizeof(handshake));
       break;
     }
     case BAUDRATE: {
       static uint8_t baudrate[2] = {0x80, 0x03};
-      usb_host_out(hub, ep, baudrate, sizeof(baudrate));
+      sent = usb_host_out(hub, ep, baudrate, sizeof(baudrate));
       break;
     }
     case NO_TIMEOUT: {
       static uint8_t no_timeout[2] = {0x80, 0x04};
-      usb_host_out(hub, ep, no_timeout, sizeof(no_timeout));
+      sent = usb_host_out(hub, ep, no_timeout, sizeof(no_timeout));
       break;
     }
     case NO_TIMEOUT2: {
-      usb_host_out(hub, ep, create_sub_command(usb_info, 0x33, 0, 0), 64);
+      sent =
+          usb_host_out(hub, ep, create_sub_command(usb_info, 0x33, 0, 0), 64);
       break;
     }
     case PLAYER_LED: {
       uint8_t led[1] = {0x01 + hub};
-      usb_host_out(hub, ep,
-                   create_sub_command(usb_info, 0x30, led, sizeof(led)), 64);
+      sent = usb_host_out(
+          hub, ep, create_sub_command(usb_info, 0x30, led, sizeof(led)), 64);
       break;
     }
     case HOME_LED: {
       uint8_t led[4] = {0x01, 0xf0, 0xf0, 0x00};
-      usb_host_out(hub, ep,
-                   create_sub_command(usb_info, 0x38, led, sizeof(led)), 64);
+      sent = usb_host_out(
+          hub, ep, create_sub_command(usb_info, 0x38, led, sizeof(led)), 64);
+      break;
     }
     case REPORT_MODE: {
       uint8_t mode[1] = {0x30};
-      usb_host_out(hub, ep,
-                   create_sub_command(usb_info, 0x03, mode, sizeof(mode)), 64);
+      sent = usb_host_out(
+          hub, ep, create_sub_command(usb_info, 0x03, mode, sizeof(mode)), 64);
+      break;
     }
     case REQUEST_MAC_IN:
     case HANDSHAKE_IN:
@@ -265,15 +262,16 @@ void hid_switch_poll(uint8_t hub, struct usb_info* usb_info) {
     case PLAYER_LED_IN:
     case HOME_LED_IN:
     case REPORT_MODE_IN:
-      usb_host_in_data0(hub, ep, 64);
+      sent = usb_host_in(hub, ep, 64);
       break;
     case INITIALIZED:
-      usb_host_in_data0(hub, ep, 64);
+      usb_host_in(hub, ep, 64);
       if (usb_info->pid == 0x200e)
         switch_info[hub].joycon = (switch_info[hub].joycon + 1) & 1;
       return;
     default:
       return;
   }
-  usb_info->state++;
+  if (sent)
+    usb_info->state++;
 }
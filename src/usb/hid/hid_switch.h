@@ -10,12 +10,8 @@
 
 struct hid_info;
 struct usb_info;
-struct usb_desc_device;
-struct usb_desc_interface;
 
-bool hid_switch_check_device_desc(struct hid_info* hid_info,
-                                  struct usb_info* usb_info,
-                                  const struct usb_desc_device* desc);
+void hid_switch_probe(struct usb_info* usb_info);
 
 bool hid_switch_initialize(struct hid_info* hid_info);
 
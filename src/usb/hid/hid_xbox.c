@@ -15,51 +15,9 @@ enum {
   STARTED,
 };
 
-static bool check(struct hid_info* hid_info,
-                  uint8_t any_class,
-                  uint8_t any_subclass,
-                  uint8_t any_protocol) {
-  if (any_class == 0xff && any_subclass == 0x5d && any_protocol == 0x01) {
-    // Might be a Xbox 360 compatible controller.
-    hid_info->type = HID_TYPE_XBOX_360;
-    hid_info->report_desc_size = 1;
-    return true;
-  }
-  if (any_class == 0xff && any_subclass == 0x47 && any_protocol == 0xd0) {
-    // Might be a Xbox One compatible controller.
-    hid_info->type = HID_TYPE_XBOX_ONE;
-    hid_info->report_desc_size = 1;
-    return true;
-  }
-  return false;
-}
-
-bool hid_xbox_check_device_desc(struct hid_info* hid_info,
-                                const struct usb_desc_device* desc) {
-  if (desc->idVendor == 0x045e) {
-    // Microsoft Xbox 360 / ONE official controllers.
-    if (desc->idProduct == 0x028e) {
-      hid_info->type = HID_TYPE_XBOX_360;
-      hid_info->report_desc_size = 1;
-      return true;
-    }
-    if (desc->idProduct == 0x02d1 || desc->idProduct == 0x02dd ||
-        desc->idProduct == 0x02e3 || desc->idProduct == 0x02ea ||
-        desc->idProduct == 0x0b00 || desc->idProduct == 0x0b0a ||
-        desc->idProduct == 0x0b12) {
-      hid_info->type = HID_TYPE_XBOX_ONE;
-      hid_info->report_desc_size = 1;
-      return true;
-    }
-  }
-  return check(hid_info, desc->bDeviceClass, desc->bDeviceSubClass,
-               desc->bDeviceProtocol);
-}
-
-bool hid_xbox_check_interface_desc(struct hid_info* hid_info,
-                                   const struct usb_desc_interface* intf) {
-  return check(hid_info, intf->bInterfaceClass, intf->bInterfaceSubClass,
-               intf->bInterfaceProtocol);
+void hid_xbox_probe(struct hid_info* hid_info) {
+  // Reports have a fixed format without HID report descriptors.
+  hid_info->report_desc_size = 1;
 }
 
 bool hid_xbox_initialize(struct hid_info* hid_info, struct usb_info* usb_info) {
@@ -148,12 +106,12 @@ bool hid_xbox_initialize(struct hid_info* hid_info, struct usb_info* usb_info) {
     hid_info->axis_polarity[3] = true;
     hid_info->axis[4] = 6 * 8;
     hid_info->axis_size[4] = 16;
-    hid_info->axis_shift[4] = 5;
+    hid_info->axis_shift[4] = 6;
     hid_info->axis_sign[4] = false;
     hid_info->axis_polarity[4] = false;
     hid_info->axis[5] = 8 * 8;
     hid_info->axis_size[5] = 16;
-    hid_info->axis_shift[5] = 5;
+    hid_info->axis_shift[5] = 6;
     hid_info->axis_sign[5] = false;
     hid_info->axis_polarity[5] = false;
     hid_info->hat = 0xffff;
@@ -194,8 +152,8 @@ void hid_xbox_360_poll(uint8_t hub, struct usb_info* usb_info) {
   if (usb_info->state == CONNECTED) {
     static uint8_t initialize[] = {0x01, 0x03, 0x00};
     initialize[2] = 0x02 + hub;
-    usb_host_out(hub, usb_info->ep_out, initialize, sizeof(initialize));
-    usb_info->state = INITIALIZED;
+    if (usb_host_out(hub, usb_info->ep_out, initialize, sizeof(initialize)))
+      usb_info->state = INITIALIZED;
   } else if (usb_info->state == INITIALIZED) {
     usb_host_in(hub, usb_info->ep_in, 20);
   }
@@ -204,14 +162,18 @@ void hid_xbox_360_poll(uint8_t hub, struct usb_info* usb_info) {
 void hid_xbox_one_poll(uint8_t hub, struct usb_info* usb_info) {
   if (usb_info->state == CONNECTED) {
     static uint8_t initialize[] = {0x05, 0x20, 0x00, 0x01, 0x00};
-    initialize[2] = usb_info->cmd_count++;
-    usb_host_out(hub, usb_info->ep_out, initialize, sizeof(initialize));
-    usb_info->state = INITIALIZED;
+    initialize[2] = usb_info->cmd_count;
+    if (usb_host_out(hub, usb_info->ep_out, initialize, sizeof(initialize))) {
+      usb_info->cmd_count++;
+      usb_info->state = INITIALIZED;
+    }
   } else if (usb_info->state == INITIALIZED) {
     static uint8_t start[] = {0x06, 0x20, 0x00, 0x02, 0x01, 0x00};
-    start[2] = usb_info->cmd_count++;
-    usb_host_out(hub, usb_info->ep_out, start, sizeof(start));
-    usb_info->state = STARTED;
+    start[2] = usb_info->cmd_count;
+    if (usb_host_out(hub, usb_info->ep_out, start, sizeof(start))) {
+      usb_info->cmd_count++;
+      usb_info->state = STARTED;
+    }
   } else if (usb_info->state == STARTED) {
     usb_host_in(hub, usb_info->ep_in, usb_info->ep_max_packet_size);
   }
@@ -10,14 +10,8 @@
 
 struct hid_info;
 struct usb_info;
-struct usb_desc_device;
-struct usb_desc_interface;
 
-bool hid_xbox_check_device_desc(struct hid_info* hid_info,
-                                const struct usb_desc_device* desc);
-
-bool hid_xbox_check_interface_desc(struct hid_info* hid_info,
-                                   const struct usb_desc_interface* intf);
+void hid_xbox_probe(struct hid_info* hid_info);
 
 bool hid_xbox_initialize(struct hid_info* hid_info, struct usb_info* usb_info);
 
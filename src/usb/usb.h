@@ -161,11 +161,18 @@ enum {
   USB_DESC_SUB_CS_UNION = 0x06,
 
   // feature selector
+  USB_FEATURE_ENDPOINT_HALT = 0x00,
   USB_FEATURE_PORT_RESET = 0x04,
   USB_FEATURE_PORT_POWER = 0x08,
   USB_FEATURE_C_PORT_CONNECTION = 0x10,
   USB_FEATURE_C_PORT_RESET = 0x14,
 
+  // hub port status
+  USB_HUB_PORT_CONNECTION = 0x0001,
+  USB_HUB_PORT_ENABLE = 0x0002,
+  USB_HUB_PORT_RESET = 0x0010,
+  USB_HUB_PORT_LOW_SPEED = 0x0200,
+
   // pid
   USB_PID_OUT = 0x01,
   USB_PID_ACK = 0x02,
@@ -10,6 +10,7 @@
 #include "usb.h"
 
 // #define _USB_HOST_DBG_LOG
+// #define _USB_HOST_TRACE
 // #define _IMPL_USB_HOST_LOG_SEND
 // #define _IMPL_USB_HOST_LOG_RECV
 // #define _IMPL_USB_HOST_LOG_STALL
@@ -45,6 +46,11 @@ enum {
   STATE_SET_PORT_POWER_FEATURE_DONE,
   STATE_CLEAR_PORT_CONNECTION_FEATURE,
   STATE_CLEAR_PORT_CONNECTION_FEATURE_DONE,
+  STATE_HUB_POLL,
+  STATE_HUB_POLL_RECV,
+  STATE_HUB_GET_PORT_STATUS,
+  STATE_HUB_GET_PORT_STATUS_RECV,
+  STATE_HUB_PORT_REQUEST_DONE,
 
   STATE_DONE,
   STATE_READY,
@@ -53,15 +59,18 @@ enum {
   STATE_IN_RECV,
   STATE_OUT_DONE,
   STATE_HID_GET_REPORT,
+  STATE_REQUEST_DONE,
 
   STATE_DELAY_US,
   STATE_DELAY_MS,
+  // States for transfers in progress should follow.
   STATE_TRANSACTION,
   STATE_TRANSACTION_IN,
   STATE_TRANSACTION_OUT,
   STATE_TRANSACTION_ACK,
   STATE_TRANSACTION_CONT,
   STATE_TRANSACTION_RETRY,
+  STATE_TRANSACTION_STREAM,
 };
 
 enum {
@@ -72,6 +81,23 @@ enum {
 
 #define AUTO_TOGGLE (bUH_R_TOG | bUH_R_AUTO_TOG | bUH_T_TOG | bUH_T_AUTO_TOG)
 
+// Bus arbitration priorities. Interrupt IN polls win over control and other
+// background transfers.
+enum {
+  PRIORITY_NONE,
+  PRIORITY_BACKGROUND,
+  PRIORITY_PERIODIC,
+};
+
+#define NO_PARENT 0xff
+#define HUB_DRIVER (USB_HOST_MAX_DEVICES > 2)
+// Interval to check port status changes of external hubs if the status change
+// endpoint does not declare it.
+#define HUB_POLL_INTERVAL_MS 32
+// IN packets with an unexpected data toggle that a transfer drops as resent
+// ones. The toggle follows the device after this.
+#define TOGGLE_DROP_LIMIT 3
+
 static struct usb_setup_req set_address_descriptor = {
     USB_REQ_DIR_OUT | USB_REQ_TYPE_STANDARD | USB_REQ_RECPT_DEVICE,
     USB_SET_ADDRESS,
@@ -156,60 +182,269 @@ static struct usb_setup_req clear_port_connection_feature = {
     0x0000,  // Port: can be modified
     0x0000,
 };
+#if HUB_DRIVER
+static struct usb_setup_req hub_port_request = {
+    USB_REQ_DIR_OUT | USB_REQ_TYPE_CLASS | USB_REQ_RECPT_OTHER,
+    USB_SET_FEATURE,  // request: can be modified
+    0x0000,           // feature: can be modified
+    0x0000,           // Port: can be modified
+    0x0000,           // requesting status size: can be modified
+};
+#endif
+
+// Conservative timings that are known to work with various devices.
+const struct usb_host_timing usb_host_timing_compatible = {
+    1000,  // attach_ms
+    200,   // reset_ms
+    15,    // second_reset_ms
+    1000,  // reset_recovery_us
+    10,    // enable_ms
+    5,     // set_address_ms
+    1000,  // request_gap_us
+    5,     // settle_ms
+    true,  // double_reset
+    true,  // stage_gap
+};
+
+// Minimum timings the USB 2.0 specification requires.
+const struct usb_host_timing usb_host_timing_fast = {
+    100,    // attach_ms: TATTDB
+    50,     // reset_ms: TDRSTR
+    50,     // second_reset_ms: TDRSTR
+    250,    // reset_recovery_us
+    10,     // enable_ms: TRSTRCY
+    2,      // set_address_ms: TDSETADDR
+    0,      // request_gap_us
+    0,      // settle_ms
+    false,  // double_reset
+    false,  // stage_gap
+};
 
 static struct usb_host* usb_host = 0;
+static const struct usb_host_timing* timing = &usb_host_timing_compatible;
 
 static uint8_t _rx_buffer[64 + 1];
 static uint8_t* rx_buffer = _rx_buffer;
-static uint8_t buffer[1024];
+static uint8_t buffer[USB_HOST_BUFFER_SIZE];
 static uint8_t _tx_buffer[64 + 1];
 static uint8_t* tx_buffer = _tx_buffer;
-static uint16_t ep_max_packet_size[2][16];
-
-static int8_t transaction_lock = -1;
+static uint16_t ep_max_packet_size[USB_HOST_MAX_DEVICES][16];
+// Polling intervals of interrupt IN endpoints in ms, and when they were polled.
+static uint8_t ep_interval[USB_HOST_MAX_DEVICES][16];
+static uint16_t ep_polled[USB_HOST_MAX_DEVICES][16];
+// Interrupt IN endpoint that the device polled last, or 0.
+static uint8_t periodic_ep[USB_HOST_MAX_DEVICES];
+// Data toggles of non-control endpoints. Bit n is set if the next packet on
+// the endpoint n is DATA1.
+static uint16_t toggle_in[USB_HOST_MAX_DEVICES];
+static uint16_t toggle_out[USB_HOST_MAX_DEVICES];
+static struct usb_host_configuration configuration[USB_HOST_MAX_DEVICES];
+
+static volatile int8_t transaction_lock = -1;
 static uint8_t* transaction_buffer = 0;
 static uint16_t transaction_size = 0;
 static uint8_t transaction_recv_state = STATE_IDLE;
 static uint8_t transaction_ep_pid = 0;
 static uint8_t transaction_stage = 0;  // 0: setup, 1: status, 2: non-setup data
-
-static uint8_t state[2] = {STATE_IDLE, STATE_IDLE};
-static bool initial_check[2] = {false, false};
-static uint16_t delay_begin[2] = {0, 0};
-static uint16_t delay_end[2] = {0, 0};
-static uint8_t delay_next_state[2] = {0, 0};
+static volatile uint8_t transaction_result = USB_HOST_RESULT_OK;
+static bool transaction_zero_copy = false;
+// Set for bulk transfers that chain packets without gaps.
+static bool transaction_bulk = false;
+static uint8_t toggle_drops = 0;
+// Set for descriptors that are passed to parsers packet by packet. Each packet
+// is received at the head of `buffer`.
+static bool transaction_stream = false;
+static uint8_t stream_size = 0;  // size of the last packet
+static uint16_t stream_offset = 0;
+static struct usb_host_config_parser config_parser;
+static bool rx_direct = false;
+
+static volatile uint8_t state[USB_HOST_MAX_DEVICES];
+static bool initial_check[USB_HOST_MAX_DEVICES];
+static uint16_t delay_begin[USB_HOST_MAX_DEVICES];
+static uint16_t delay_end[USB_HOST_MAX_DEVICES];
+static uint8_t delay_next_state[USB_HOST_MAX_DEVICES];
 static bool resetting[2] = {false, false};
-static bool no_remote_wakeup[2] = {false, false};
-static bool is_hid[2] = {false, false};
-static uint8_t hid_boot[2] = {BOOT_NOT_SUPPORTED, BOOT_NOT_SUPPORTED};
-static uint8_t hub_ports[2] = {0, 0};
-static uint8_t hub_address[2] = {0, 0};
-static uint8_t hid_interface_number[2] = {0xff, 0xff};
-static bool do_not_retry[2] = {false, false};
+static uint8_t halt_retry[USB_HOST_MAX_DEVICES];
+static bool no_remote_wakeup[USB_HOST_MAX_DEVICES];
+static bool is_hid[USB_HOST_MAX_DEVICES];
+static uint8_t hid_boot[USB_HOST_MAX_DEVICES];
+static uint8_t hub_ports[USB_HOST_MAX_DEVICES];
+static uint8_t hub_address[USB_HOST_MAX_DEVICES];
+static uint8_t hid_interface_number[USB_HOST_MAX_DEVICES];
+static bool cached[USB_HOST_MAX_DEVICES];
+static bool do_not_retry[USB_HOST_MAX_DEVICES];
+static uint8_t quirks[USB_HOST_MAX_DEVICES];
 static uint16_t user_request_size = 0;
-static uint8_t string_index[3] = {0, 0, 0};
+static uint8_t string_index[USB_HOST_MAX_DEVICES][3];
+
+// Enumeration releases the bus between transfers so that devices enumerate
+// concurrently. Request fields that persist across states are kept per device,
+// and copied into the shared setup requests right before each transfer.
+static uint16_t desc_length[USB_HOST_MAX_DEVICES];
+static uint8_t configuration_value[USB_HOST_MAX_DEVICES];
+static uint8_t hid_report_desc_interface[USB_HOST_MAX_DEVICES];
+static uint16_t hid_report_desc_length[USB_HOST_MAX_DEVICES];
+static uint8_t setup_port[USB_HOST_MAX_DEVICES];
+// Only one device can be in the default state to respond at the address 0.
+// Owned from the bus reset until SET_ADDRESS completes.
+static int8_t address0_owner = -1;
+
+// Device table. Root ports have NO_PARENT, and devices behind external hubs
+// have the index of the hub device and the port number on the hub.
+static uint8_t parent[USB_HOST_MAX_DEVICES];
+static uint8_t parent_port[USB_HOST_MAX_DEVICES];
+static bool low_speed[USB_HOST_MAX_DEVICES];
+#if HUB_DRIVER
+static uint8_t hub_ep[USB_HOST_MAX_DEVICES];
+static uint8_t hub_port[USB_HOST_MAX_DEVICES];
+static bool hub_port_debounced[USB_HOST_MAX_DEVICES];
+#endif
+
+static struct usb_host_request* queue[USB_HOST_MAX_DEVICES]
+                                     [USB_HOST_QUEUE_SIZE];
+static volatile uint8_t queue_head[USB_HOST_MAX_DEVICES];
+static volatile uint8_t queue_count[USB_HOST_MAX_DEVICES];
+static struct usb_host_request* active_request[USB_HOST_MAX_DEVICES];
+
+// Registered class drivers, and the one that takes each device.
+static const struct usb_host_driver* drivers[USB_HOST_MAX_DRIVERS];
+static uint8_t driver_count = 0;
+static const struct usb_host_driver* bound_driver[USB_HOST_MAX_DEVICES];
+static struct usb_host_device device_id[USB_HOST_MAX_DEVICES];
+
+// usb_host_get_string() requests. `string_callback` is set while pending.
+static struct usb_host_request string_request[USB_HOST_MAX_DEVICES];
+static struct usb_setup_req string_setup[USB_HOST_MAX_DEVICES];
+static void (*string_callback[USB_HOST_MAX_DEVICES])(uint8_t hub,
+                                                     uint8_t index,
+                                                     const uint8_t* desc,
+                                                     uint8_t size);
+static uint8_t next_dispatch_hub = 0;
+
+#ifdef _USB_HOST_TRACE
+static struct usb_host_trace trace[USB_HOST_TRACE_SIZE];
+static uint8_t trace_write = 0;
+static uint8_t trace_read = 0;
+static uint8_t trace_seq = 0;
+#endif  // _USB_HOST_TRACE
+
+static struct usb_host_stats stats[USB_HOST_MAX_DEVICES];
+static uint16_t transfer_begin = 0;
+static uint16_t transfer_begin_sec = 0;
+static uint16_t transfer_begin_ms = 0;
+static uint16_t transfer_timeout_ms = USB_HOST_TRANSFER_TIMEOUT_MS;
+static uint16_t enumeration_begin[USB_HOST_MAX_DEVICES];
+static bool enumerating[USB_HOST_MAX_DEVICES];
+// Set from the connection until the disconnection is notified once.
+static bool attached[USB_HOST_MAX_DEVICES];
+
+// The host sends SOF every 1ms, but does not expose the frame number. Frames
+// are counted on timer3 that runs on the same clock so that they keep a fixed
+// phase to SOF.
+static uint16_t frame_number = 0;
+static uint16_t frame_ms = 0;
 
 void usb_host_log_send(uint8_t ep, uint8_t pid, uint8_t size, uint8_t* buffer);
 void usb_host_log_recv(uint8_t ep, uint8_t pid, uint8_t size, uint8_t* buffer);
 void usb_host_log_stall(void);
 void usb_host_log_nak(void);
 
+#ifdef _USB_HOST_TRACE
+static void trace_packet(uint8_t hub,
+                         uint8_t token,
+                         uint8_t size,
+                         const uint8_t* data) {
+  uint8_t seq = trace_seq++;
+  if ((uint8_t)(trace_write - trace_read) == USB_HOST_TRACE_SIZE)
+    return;
+  struct usb_host_trace* record =
+      &trace[trace_write & (USB_HOST_TRACE_SIZE - 1)];
+  record->seq = seq;
+  record->tick = timer3_tick_raw();
+  record->hub = hub;
+  record->ep_pid = transaction_ep_pid;
+  record->token = token;
+  record->size = size;
+  if (size > USB_HOST_TRACE_DATA)
+    size = USB_HOST_TRACE_DATA;
+  for (uint8_t i = 0; i < size; ++i)
+    record->data[i] = data[i];
+  trace_write++;
+}
+#endif  // _USB_HOST_TRACE
+
+static bool claim_address0(uint8_t hub) {
+  if (address0_owner >= 0 && address0_owner != (int8_t)hub)
+    return false;
+  address0_owner = hub;
+  return true;
+}
+
+static void release_address0(uint8_t hub) {
+  if (address0_owner == (int8_t)hub)
+    address0_owner = -1;
+}
+
 static void halt(uint8_t hub) {
+  stats[hub].halts++;
   state[hub] = STATE_HALT;
+  // Release the bus so that other devices, e.g. the parent hub, keep working.
+  if (transaction_lock == (int8_t)hub)
+    transaction_lock = -1;
+  release_address0(hub);
 }
 
-static void delay_us(uint8_t hub, uint16_t delay_us, uint8_t next_state) {
+// Returns true if `next_state` can run immediately without any delay.
+static bool delay_us(uint8_t hub, uint16_t delay_us, uint8_t next_state) {
+  if (!delay_us) {
+    state[hub] = next_state;
+    return true;
+  }
   delay_begin[hub] = timer3_tick_raw();
   delay_end[hub] = delay_begin[hub] + timer3_tick_from_usec(delay_us);
   delay_next_state[hub] = next_state;
   state[hub] = STATE_DELAY_US;
+  return false;
 }
 
-static void delay_ms(uint8_t hub, uint16_t delay_ms, uint8_t next_state) {
+static bool delay_ms(uint8_t hub, uint16_t delay_ms, uint8_t next_state) {
+  if (!delay_ms) {
+    state[hub] = next_state;
+    return true;
+  }
   delay_begin[hub] = timer3_tick_msec();
   delay_end[hub] = delay_begin[hub] + delay_ms;
   delay_next_state[hub] = next_state;
   state[hub] = STATE_DELAY_MS;
+  return false;
+}
+
+// Returns a gap to be inserted between stages and packets in a transfer.
+// The next stage is issued immediately if it returns 0.
+static uint16_t stage_gap_us(uint8_t hub, uint16_t gap_us) {
+  if (timing->stage_gap || (quirks[hub] & USB_HOST_QUIRK_STAGE_GAP))
+    return gap_us;
+  return 0;
+}
+
+// Returns timer3 seconds, and the msec tick in the second at `msec`. Reads
+// again if the second changes between them.
+static uint16_t tick_sec_msec(uint16_t* msec) {
+  for (;;) {
+    uint16_t sec = timer3_tick_sec();
+    *msec = timer3_tick_msec();
+    if (sec == timer3_tick_sec())
+      return sec;
+  }
+}
+
+static bool use_interrupt(void) {
+#ifdef _USB_HOST_INTERRUPT
+  return usb_host->flags & USE_INTERRUPT;
+#else
+  return false;
+#endif
 }
 
 static bool is_transaction_locked(void) {
@@ -220,11 +455,25 @@ static bool lock_transaction(uint8_t hub, uint8_t target_device_addr) {
   if (is_transaction_locked())
     return false;
   transaction_lock = hub;
-  if ((hub == 0 && (UHUB0_CTRL & bUH_LOW_SPEED) == 0) ||
-      (hub == 1 && (UHUB1_CTRL & bUH_LOW_SPEED) == 0)) {
+  transfer_begin = timer3_tick_raw();
+  transfer_begin_sec = tick_sec_msec(&transfer_begin_ms);
+  transfer_timeout_ms = USB_HOST_TRANSFER_TIMEOUT_MS;
+  transaction_stream = false;
+  transaction_bulk = false;
+  toggle_drops = 0;
+  stream_size = 0;
+  stream_offset = 0;
+  if (!low_speed[hub]) {
     USB_CTRL &= ~bUC_LOW_SPEED;
+    UH_SETUP &= ~bUH_PRE_PID_EN;
   } else {
     USB_CTRL |= bUC_LOW_SPEED;
+    if (parent[hub] == NO_PARENT) {
+      UH_SETUP &= ~bUH_PRE_PID_EN;
+    } else {
+      // Low speed devices behind a full speed hub need PRE PID.
+      UH_SETUP |= bUH_PRE_PID_EN;
+    }
   }
   USB_DEV_AD = target_device_addr;
   return true;
@@ -237,9 +486,119 @@ static bool unlock_transaction(uint8_t hub) {
   return true;
 }
 
-static bool find_string_index(uint8_t* index) {
+static void start_enumeration(uint8_t hub) {
+  stats[hub].resets++;
+  enumeration_begin[hub] = timer3_tick_msec();
+  enumerating[hub] = true;
+  attached[hub] = true;
+}
+
+static void finish_enumeration(uint8_t hub) {
+  if (!enumerating[hub])
+    return;
+  enumerating[hub] = false;
+  halt_retry[hub] = 0;
+  stats[hub].enumeration_ms = timer3_tick_msec() - enumeration_begin[hub];
+}
+
+// Completes the transfer in progress, and counts its latency.
+static void complete_transfer(uint8_t hub, uint8_t result) {
+  uint16_t ticks = timer3_tick_raw() - transfer_begin;
+  uint8_t bucket = 0;
+  while ((ticks >>= 1) && bucket < (USB_HOST_STATS_BUCKETS - 1))
+    bucket++;
+  stats[hub].latency[bucket]++;
+  transaction_result = result;
+  state[hub] = transaction_recv_state;
+}
+
+// Returns ms passed since the msec tick `begin`, up to 999. msec ticks wrap at
+// 1000 as timer3 counts up to a second.
+static uint16_t elapsed_ms(uint16_t begin) {
+  uint16_t now = timer3_tick_msec();
+  return (now >= begin) ? (now - begin) : (now + 1000 - begin);
+}
+
+// Timeouts can be longer than a second that msec ticks wrap at, and seconds
+// are counted too.
+static bool is_transfer_timed_out(void) {
+  uint16_t ms;
+  uint16_t sec = tick_sec_msec(&ms);
+  int32_t elapsed = (int32_t)(uint16_t)(sec - transfer_begin_sec) * 1000 +
+                    ((int16_t)ms - (int16_t)transfer_begin_ms);
+  return elapsed > transfer_timeout_ms;
+}
+
+static uint8_t get_device_address(uint8_t hub) {
+  return hub_address[hub] ? hub_address[hub] : (1 + hub);
+}
+
+// Locks the bus for an enumeration transfer. Devices answer at the address 0
+// until the initial check is done.
+static bool lock_device(uint8_t hub) {
+  return lock_transaction(hub,
+                          initial_check[hub] ? 0 : get_device_address(hub));
+}
+
+// Returns true if the endpoint can be polled in the current frame.
+static bool is_poll_due(uint8_t hub, uint8_t ep) {
+  uint8_t interval = ep_interval[hub][ep & 0x0f];
+  if (!interval)
+    return true;
+  return elapsed_ms(ep_polled[hub][ep & 0x0f]) >= interval;
+}
+
+static void start_poll_interval(uint8_t hub, uint8_t ep) {
+  ep_polled[hub][ep & 0x0f] = timer3_tick_msec();
+  if (ep_interval[hub][ep & 0x0f])
+    periodic_ep[hub] = ep & 0x0f;
+}
+
+// Returns how long the endpoint has been due in ms.
+static uint16_t poll_lateness(uint8_t hub, uint8_t ep) {
+  uint16_t elapsed = elapsed_ms(ep_polled[hub][ep & 0x0f]);
+  uint8_t interval = ep_interval[hub][ep & 0x0f];
+  return (elapsed > interval) ? (elapsed - interval) : 0;
+}
+
+// Returns true if the ready device is expected to poll its interrupt IN
+// endpoint now. Devices that do not poll within an interval after it gets due
+// lose the priority so that they can not block others.
+static bool is_periodic_due(uint8_t hub) {
+  uint8_t ep = periodic_ep[hub];
+  if (state[hub] != STATE_READY || !ep)
+    return false;
+  // Shares is_poll_due() so that the device can poll as soon as others yield.
+  return is_poll_due(hub, ep) &&
+         elapsed_ms(ep_polled[hub][ep]) <= ep_interval[hub][ep] * 2;
+}
+
+// Returns true if background transfers on the device should wait for others.
+static bool yields_to_periodic(uint8_t hub) {
+  for (uint8_t i = 0; i < USB_HOST_MAX_DEVICES; ++i) {
+    if (i != hub && is_periodic_due(i))
+      return true;
+  }
+  return false;
+}
+
+// Passes the packet at the head of `buffer` to the parser of the descriptor
+// being received.
+static void stream_packet(uint8_t hub) {
+  if (!stream_size)
+    return;
+  if (transaction_recv_state == STATE_GET_CONFIGURATION_DESC_RECV) {
+    usb_host_parse_configuration(&config_parser, buffer, stream_size);
+  } else if (usb_host->check_hid_report_desc) {
+    usb_host->check_hid_report_desc(hub, stream_offset, buffer, stream_size);
+  }
+  stream_offset += stream_size;
+  stream_size = 0;
+}
+
+static bool find_string_index(uint8_t hub, uint8_t* index) {
   for (uint8_t i = 0; i < 3; ++i) {
-    if (string_index[i]) {
+    if (string_index[hub][i]) {
       *index = i;
       return true;
     }
@@ -247,10 +606,52 @@ static bool find_string_index(uint8_t* index) {
   return false;
 }
 
+// Transfers on non-control endpoints take data toggles from the tables.
+static bool is_toggle_tracked(void) {
+  return transaction_stage == 2;
+}
+
+static uint16_t* toggle(uint8_t hub) {
+  return ((transaction_ep_pid >> 4) == USB_PID_IN) ? &toggle_in[hub]
+                                                   : &toggle_out[hub];
+}
+
+static uint8_t tracked_tog(uint8_t hub) {
+  uint16_t bit = 1 << (transaction_ep_pid & 0x0f);
+  return (*toggle(hub) & bit) ? (bUH_R_TOG | bUH_T_TOG) : 0;
+}
+
+static void flip_toggle(uint8_t hub) {
+  *toggle(hub) ^= 1 << (transaction_ep_pid & 0x0f);
+}
+
+// Devices reset data toggles to DATA0 on these requests.
+static void reset_toggles(uint8_t hub, const struct usb_setup_req* req) {
+  if (req->bRequestType ==
+          (USB_REQ_DIR_OUT | USB_REQ_TYPE_STANDARD | USB_REQ_RECPT_DEVICE) &&
+      req->bRequest == USB_SET_CONFIGURATION) {
+    toggle_in[hub] = 0;
+    toggle_out[hub] = 0;
+  } else if (req->bRequestType == (USB_REQ_DIR_OUT | USB_REQ_TYPE_STANDARD |
+                                   USB_REQ_RECPT_ENDPOINT) &&
+             req->bRequest == USB_CLEAR_FEATURE &&
+             req->wValue == USB_FEATURE_ENDPOINT_HALT) {
+    uint16_t bit = 1 << (req->wIndex & 0x0f);
+    if (req->wIndex & 0x80) {
+      toggle_in[hub] &= ~bit;
+    } else {
+      toggle_out[hub] &= ~bit;
+    }
+  }
+}
+
 static void host_transact_cont(uint8_t hub, uint8_t tog) {
   uint16_t size;
   if ((transaction_ep_pid >> 4) != USB_PID_IN) {
-    size = (transaction_size < 64) ? transaction_size : 64;
+    uint16_t max_size =
+        transaction_bulk ? ep_max_packet_size[hub][transaction_ep_pid & 0x0f]
+                         : 64;
+    size = (transaction_size < max_size) ? transaction_size : max_size;
     for (uint16_t i = 0; i < size; ++i)
       tx_buffer[i] = transaction_buffer[i];
     transaction_buffer += size;
@@ -259,17 +660,27 @@ static void host_transact_cont(uint8_t hub, uint8_t tog) {
   } else {
     size = transaction_size;
     UH_TX_LEN = 0;
+    // Let DMA write into the destination directly if possible.
+    rx_direct = transaction_zero_copy && !((uint16_t)transaction_buffer & 1);
+    uint8_t* rx = rx_direct ? transaction_buffer : rx_buffer;
+    UH_RX_DMA_H = (uint16_t)rx >> 8;
+    UH_RX_DMA_L = (uint16_t)rx & 0xff;
   }
 
 #ifdef _USB_HOST_DBG_LOG
   usb_host_log_send(transaction_ep_pid & 0x0f, transaction_ep_pid >> 4,
                     UH_TX_LEN, tx_buffer);
 #endif  // _USB_HOST_DBG_LOG
+#ifdef _USB_HOST_TRACE
+  trace_packet(hub, USB_HOST_TRACE_SEND, UH_TX_LEN, tx_buffer);
+#endif  // _USB_HOST_TRACE
 
+  // Update the state before starting the transaction so that the interrupt
+  // handler can take the completion.
+  state[hub] = STATE_TRANSACTION;
   UH_EP_PID = transaction_ep_pid;
-  UH_RX_CTRL = UH_TX_CTRL = tog;
+  UH_RX_CTRL = UH_TX_CTRL = is_toggle_tracked() ? tracked_tog(hub) : tog;
   UIF_TRANSFER = 0;
-  state[hub] = STATE_TRANSACTION;
 }
 
 static void host_transact(uint8_t hub,
@@ -291,15 +702,19 @@ static void host_setup_transfer(uint8_t hub,
                                 uint16_t size,
                                 uint8_t recv_state) {
   transaction_stage = 0;
+  transaction_zero_copy = false;
+  reset_toggles(hub, (const struct usb_setup_req*)buffer);
   host_transact(hub, buffer, size, recv_state, 0, USB_PID_SETUP, 0);
 }
 
 static void host_in_transfer(uint8_t hub,
                              uint8_t ep,
+                             uint8_t* dst,
                              uint16_t size,
                              uint8_t recv_state,
                              uint8_t tog) {
-  host_transact(hub, buffer, size, recv_state, ep, USB_PID_IN, tog);
+  transaction_zero_copy = dst != buffer;
+  host_transact(hub, dst, size, recv_state, ep, USB_PID_IN, tog);
 }
 
 static void host_out_transfer(uint8_t hub,
@@ -308,6 +723,7 @@ static void host_out_transfer(uint8_t hub,
                               uint16_t size,
                               uint8_t recv_state,
                               uint8_t tog) {
+  transaction_zero_copy = false;
   host_transact(hub, buffer, size, recv_state, ep, USB_PID_OUT, tog);
 }
 
@@ -316,21 +732,28 @@ static void host_ack_transfer(uint8_t hub,
                               uint8_t* buffer,
                               uint16_t size,
                               uint8_t recv_state) {
+  transaction_zero_copy = false;
   host_transact(hub, buffer, size, recv_state, ep, USB_PID_ACK, 0);
 }
 
 static bool state_idle(uint8_t hub) {
+  // Devices behind hubs are attached by the hub driver.
   if ((hub == 0 && (USB_HUB_ST & bUHS_H0_ATTACH)) ||
       (hub == 1 && (USB_HUB_ST & bUHS_H1_ATTACH))) {
-    // Wait 1000ms (>100ms) for devices to be stable.
-    delay_ms(hub, 1000, STATE_CONNECT);
+    // Wait for devices to be stable.
+    halt_retry[hub] = 0;
+    return delay_ms(hub, timing->attach_ms, STATE_CONNECT);
   }
   return false;
 }
 
 static bool state_connect(uint8_t hub) {
-  // Reset the bus, and wait 200ms (>15ms). This timing is quite sensitive as
-  // shorter reset and longer reset both doesn't work well on some devices.
+  // Wait until the other port assigns an address to its device.
+  if (!claim_address0(hub)) {
+    return false;
+  }
+  // Reset the bus. This timing is quite sensitive as shorter reset and longer
+  // reset both doesn't work well on some devices.
   // The device may be disconnected during the reset.
   resetting[hub] = true;
   if (!hub) {
@@ -340,19 +763,19 @@ static bool state_connect(uint8_t hub) {
   }
   initial_check[hub] = true;
   hub_address[hub] = 0;
-  delay_ms(hub, 200, STATE_RESET);
-  return false;
+  quirks[hub] = 0;
+  start_enumeration(hub);
+  return delay_ms(hub, timing->reset_ms, STATE_RESET);
 }
 
 static bool state_reset(uint8_t hub) {
-  // Stop resetting, and wait 1ms (>250us).
+  // Stop resetting, and wait for the recovery.
   if (!hub) {
     UHUB0_CTRL &= ~bUH_BUS_RESET;
   } else {
     UHUB1_CTRL &= ~bUH_BUS_RESET;
   }
-  delay_us(hub, 1000, STATE_ENABLE);
-  return false;
+  return delay_us(hub, timing->reset_recovery_us, STATE_ENABLE);
 }
 
 static bool state_enable(uint8_t hub) {
@@ -364,18 +787,19 @@ static bool state_enable(uint8_t hub) {
   resetting[hub] = false;
 
   if (!hub) {
-    if (USB_HUB_ST & bUHS_DM_LEVEL)
+    low_speed[hub] = USB_HUB_ST & bUHS_DM_LEVEL;
+    if (low_speed[hub])
       UHUB0_CTRL |= bUH_LOW_SPEED;
     UHUB0_CTRL |= bUH_PORT_EN;
   } else {
-    if (USB_HUB_ST & bUHS_HM_LEVEL)
+    low_speed[hub] = USB_HUB_ST & bUHS_HM_LEVEL;
+    if (low_speed[hub])
       UHUB1_CTRL |= bUH_LOW_SPEED;
     UHUB1_CTRL |= bUH_PORT_EN;
   }
-  // Wait 10ms (>200us).
-  delay_ms(hub, 10,
-           initial_check[hub] ? STATE_GET_DEVICE_DESC : STATE_SET_ADDRESS);
-  return false;
+  return delay_ms(hub, timing->enable_ms,
+                  initial_check[hub] ? STATE_GET_DEVICE_DESC
+                                     : STATE_SET_ADDRESS);
 }
 
 static bool state_set_address(uint8_t hub) {
@@ -383,8 +807,7 @@ static bool state_set_address(uint8_t hub) {
     return false;
   }
 
-  set_address_descriptor.wValue =
-      hub_address[hub] ? hub_address[hub] : (1 + hub);
+  set_address_descriptor.wValue = get_device_address(hub);
   host_setup_transfer(hub, (uint8_t*)&set_address_descriptor,
                       sizeof(set_address_descriptor), STATE_SET_ADDRESS_DONE);
   return false;
@@ -392,14 +815,12 @@ static bool state_set_address(uint8_t hub) {
 
 static bool state_set_address_done(uint8_t hub) {
   unlock_transaction(hub);
-  lock_transaction(hub, set_address_descriptor.wValue);
-  // Wait 5ms (>2ms)
-  delay_ms(hub, 5, STATE_GET_DEVICE_DESC);
-  return false;
+  release_address0(hub);
+  return delay_ms(hub, timing->set_address_ms, STATE_GET_DEVICE_DESC);
 }
 
 static bool state_get_device_desc(uint8_t hub) {
-  if (initial_check[hub] && !lock_transaction(hub, 0)) {
+  if (!lock_device(hub)) {
     return false;
   }
 
@@ -415,15 +836,19 @@ static bool state_get_device_desc_recv(uint8_t hub) {
   if (initial_check[hub]) {
     // Initial check is done. Let's try full boot.
     unlock_transaction(hub);
+    ep_max_packet_size[hub][0] = desc->bMaxPacketSize0;
+    if (!timing->double_reset || parent[hub] != NO_PARENT) {
+      initial_check[hub] = false;
+      return delay_us(hub, timing->request_gap_us, STATE_SET_ADDRESS);
+    }
     state_connect(hub);
     initial_check[hub] = false;
-    ep_max_packet_size[hub][0] = desc->bMaxPacketSize0;
-    delay_ms(hub, 15, STATE_RESET);
-    return false;
+    return delay_ms(hub, timing->second_reset_ms, STATE_RESET);
   }
   if (usb_host->check_device_desc) {
     usb_host->check_device_desc(hub, buffer);
   }
+  unlock_transaction(hub);
 
   ep_max_packet_size[hub][0] = desc->bMaxPacketSize0;
   is_hid[hub] = desc->bDeviceClass == USB_CLASS_HID;
@@ -435,26 +860,37 @@ static bool state_get_device_desc_recv(uint8_t hub) {
                       ? BOOT_SELECTED
                       : BOOT_SUPPORTED;
   hub_ports[hub] = (desc->bDeviceClass == USB_CLASS_HUB) ? 1 : 0;
-  string_index[0] = desc->iManufacturer;
-  string_index[1] = desc->iProduct;
-  string_index[2] = desc->iSerialNumber;
+  cached[hub] = false;
+  device_id[hub].vid = desc->idVendor;
+  device_id[hub].pid = desc->idProduct;
+  device_id[hub].class_code = desc->bDeviceClass;
+  device_id[hub].subclass = desc->bDeviceSubClass;
+  device_id[hub].protocol = desc->bDeviceProtocol;
+  if (usb_host->flags & USE_STRING_DESC) {
+    string_index[hub][0] = desc->iManufacturer;
+    string_index[hub][1] = desc->iProduct;
+    string_index[hub][2] = desc->iSerialNumber;
+  } else {
+    string_index[hub][0] = string_index[hub][1] = string_index[hub][2] = 0;
+  }
 
   // Setup requests to ask the core part for the first request.
-  get_string_descriptor.wLength = 0x0002;
-  get_configuration_descriptor.wLength = 0x0009;
-  get_hub_descriptor.wLength = 0x0008;
+  desc_length[hub] = 0x0009;
 
-  delay_us(hub, 1000, STATE_GET_STRING_DESC);
-  return false;
+  return delay_us(hub, timing->request_gap_us, STATE_GET_CONFIGURATION_DESC);
 }
 
 static bool state_get_string_desc(uint8_t hub) {
   uint8_t i = 0;
-  if (!find_string_index(&i)) {
-    state[hub] = STATE_GET_CONFIGURATION_DESC;
+  if (!find_string_index(hub, &i)) {
+    state[hub] = STATE_SET_CONFIGURATION;
     return true;
   }
-  get_string_descriptor.wValue = (USB_DESC_STRING << 8) | string_index[i];
+  if (!lock_device(hub)) {
+    return false;
+  }
+  get_string_descriptor.wValue = (USB_DESC_STRING << 8) | string_index[hub][i];
+  get_string_descriptor.wLength = desc_length[hub];
   host_setup_transfer(hub, (uint8_t*)&get_string_descriptor,
                       sizeof(get_string_descriptor),
                       STATE_GET_STRING_DESC_RECV);
@@ -462,105 +898,171 @@ static bool state_get_string_desc(uint8_t hub) {
 }
 
 static bool state_get_string_desc_recv(uint8_t hub) {
-  if (get_string_descriptor.wLength == 2) {
+  if (desc_length[hub] == 2) {
     const struct usb_desc_head* head = (const struct usb_desc_head*)buffer;
     if (head->bLength != 2 && head->bLength) {
       // Request full part.
-      get_string_descriptor.wLength = head->bLength;
-      delay_us(hub, 1000, STATE_GET_STRING_DESC);
-      return false;
+      unlock_transaction(hub);
+      desc_length[hub] = (head->bLength < USB_HOST_BUFFER_SIZE)
+                             ? head->bLength
+                             : USB_HOST_BUFFER_SIZE;
+      return delay_us(hub, timing->request_gap_us, STATE_GET_STRING_DESC);
     }
   }
 
   uint8_t i = 0;
-  find_string_index(&i);
+  find_string_index(hub, &i);
 
   if (usb_host->check_string_desc) {
-    usb_host->check_string_desc(hub, string_index[i], buffer);
+    usb_host->check_string_desc(hub, string_index[hub][i], buffer);
   }
+  unlock_transaction(hub);
 
-  string_index[i] = 0;
-  if (find_string_index(&i)) {
+  string_index[hub][i] = 0;
+  if (find_string_index(hub, &i)) {
     // Request core part.
-    get_string_descriptor.wLength = 2;
-    delay_us(hub, 1000, STATE_GET_STRING_DESC);
-    return false;
+    desc_length[hub] = 2;
+    return delay_us(hub, timing->request_gap_us, STATE_GET_STRING_DESC);
   }
-  delay_us(hub, 1000, STATE_GET_CONFIGURATION_DESC);
-  return false;
+  return delay_ms(hub, timing->settle_ms, STATE_SET_CONFIGURATION);
 }
 
 static bool state_get_configuration_desc(uint8_t hub) {
+  if (!lock_device(hub)) {
+    return false;
+  }
+  get_configuration_descriptor.wLength = desc_length[hub];
+  transaction_stream = true;
+  usb_host_parse_configuration_begin(&config_parser, &configuration[hub]);
   host_setup_transfer(hub, (uint8_t*)&get_configuration_descriptor,
                       sizeof(get_configuration_descriptor),
                       STATE_GET_CONFIGURATION_DESC_RECV);
   return false;
 }
 
+static void setup_endpoints(uint8_t hub,
+                            const struct usb_host_interface* intf) {
+  const struct usb_host_configuration* conf = &configuration[hub];
+  for (uint8_t i = 0; i < intf->endpoints; ++i) {
+    const struct usb_host_endpoint* ep =
+        &conf->endpoint[intf->first_endpoint + i];
+    ep_max_packet_size[hub][ep->address & 0x0f] = ep->max_packet_size;
+    if ((ep->address & 0x80) && (ep->attributes & 3) == 3) {
+      // Interrupt IN endpoints are polled every bInterval frames.
+      ep_interval[hub][ep->address & 0x0f] = ep->interval;
+    }
+#if HUB_DRIVER
+    if (ep->address & 0x80)
+      hub_ep[hub] = ep->address & 0x0f;  // Status change endpoint.
+#endif
+  }
+}
+
+// Returns true if `intf` is the interface to use as a HID device.
+static bool select_hid_interface(uint8_t hub,
+                                 const struct usb_host_interface* intf) {
+  if (intf->class_code == USB_CLASS_HID) {
+    is_hid[hub] = true;
+    if (intf->subclass == USB_HID_SUBCLASS_BOOT) {
+      hid_boot[hub] = (intf->protocol == USB_HID_PROTOCOL_KEYBOARD)
+                          ? BOOT_SELECTED
+                          : BOOT_SUPPORTED;
+    }
+  }
+  if (intf->hid_report_desc_length) {
+    hid_report_desc_length[hub] = intf->hid_report_desc_length;
+  }
+  if ((is_hid[hub] && hid_interface_number[hub] == 0xff) ||
+      hid_interface_number[hub] == intf->number) {
+    hid_interface_number[hub] = intf->number;
+    hid_report_desc_interface[hub] = intf->number;
+    return true;
+  }
+  return false;
+}
+
+// Walks ID tables of registered drivers, and binds the first driver that
+// takes the device.
+static void bind_driver(uint8_t hub) {
+  const struct usb_host_configuration* conf = &configuration[hub];
+  bound_driver[hub] = 0;
+  for (uint8_t i = 0; i < driver_count; ++i) {
+    const struct usb_host_driver* driver = drivers[i];
+    const struct usb_host_id* id =
+        usb_host_match(driver->ids, driver->id_count, &device_id[hub], 0);
+    if (id && driver->probe(hub, id, 0)) {
+      bound_driver[hub] = driver;
+      return;
+    }
+    for (uint8_t j = 0; j < conf->interfaces; ++j) {
+      const struct usb_host_interface* intf = &conf->interface[j];
+      id = usb_host_match(driver->ids, driver->id_count, &device_id[hub], intf);
+      if (id && driver->probe(hub, id, intf)) {
+        bound_driver[hub] = driver;
+        return;
+      }
+    }
+  }
+}
+
 static bool state_get_configuration_desc_recv(uint8_t hub) {
-  const struct usb_desc_configuration* desc =
-      (const struct usb_desc_configuration*)buffer;
-  if (get_configuration_descriptor.wLength != desc->wTotalLength) {
-    // Request full part.
-    get_configuration_descriptor.wLength = desc->wTotalLength;
-    delay_us(hub, 1000, STATE_GET_CONFIGURATION_DESC);
+  if (transaction_result != USB_HOST_RESULT_OK) {
+    halt(hub);
     return false;
   }
-  no_remote_wakeup[hub] = (desc->bmAttributes & 0x20) == 0;
-  if (usb_host->check_configuration_desc) {
-    hid_interface_number[hub] = usb_host->check_configuration_desc(hub, buffer);
+  stream_packet(hub);
+  struct usb_host_configuration* conf = &configuration[hub];
+  if (desc_length[hub] != conf->total_length) {
+    // Request full part.
+    unlock_transaction(hub);
+    desc_length[hub] = conf->total_length;
+    return delay_us(hub, timing->request_gap_us,
+                    STATE_GET_CONFIGURATION_DESC);
+  }
+  no_remote_wakeup[hub] = (conf->attributes & 0x20) == 0;
+  bind_driver(hub);
+  if (bound_driver[hub]) {
+    // HID specific steps are left to the driver.
+    hid_boot[hub] = BOOT_NOT_SUPPORTED;
+  } else if (usb_host->check_configuration_desc) {
+    hid_interface_number[hub] = usb_host->check_configuration_desc(hub, conf);
   }
-  set_configuration_descriptor.wValue = desc->bConfigurationValue;
+  configuration_value[hub] = conf->value;
   // Note: multiple configurations are not supported.
 
   for (uint8_t i = 1; i < 16; ++i) {
     ep_max_packet_size[hub][i] = 0;
+    ep_interval[hub][i] = 0;
   }
-
-  bool selected = false;
-  for (uint16_t offset = 0; offset < desc->wTotalLength;) {
-    const struct usb_desc_head* head =
-        (const struct usb_desc_head*)(buffer + offset);
-    if (head->bDescriptorType == USB_DESC_INTERFACE) {
-      if (selected) {
-        break;
-      }
-      const struct usb_desc_interface* intf =
-          (const struct usb_desc_interface*)(buffer + offset);
-      if (intf->bInterfaceClass == USB_CLASS_HID) {
-        is_hid[hub] = true;
-        if (intf->bInterfaceSubClass == USB_HID_SUBCLASS_BOOT) {
-          hid_boot[hub] =
-              (intf->bInterfaceProtocol == USB_HID_PROTOCOL_KEYBOARD)
-                  ? BOOT_SELECTED
-                  : BOOT_SUPPORTED;
-        }
-      }
-      if (is_hid[hub] && hid_interface_number[hub] == 0xff) {
-        hid_interface_number[hub] = intf->bInterfaceNumber;
-        get_hid_report_descriptor.wIndex = intf->bInterfaceNumber;
-        selected = true;
-      } else if (hid_interface_number[hub] == intf->bInterfaceNumber) {
-        get_hid_report_descriptor.wIndex = intf->bInterfaceNumber;
-        selected = true;
-      }
-    }
-    if (head->bDescriptorType == USB_DESC_HID) {
-      const struct usb_desc_hid* hid =
-          (const struct usb_desc_hid*)(buffer + offset);
-      get_hid_report_descriptor.wLength = hid->wDescriptorLength;
-    } else if (head->bDescriptorType == USB_DESC_ENDPOINT) {
-      const struct usb_desc_endpoint* ep =
-          (const struct usb_desc_endpoint*)(buffer + offset);
-      ep_max_packet_size[hub][ep->bEndpointAddress & 0x0f] = ep->wMaxPacketSize;
+  periodic_ep[hub] = 0;
+
+  // Interfaces up to the selected one set up endpoints for HID devices, and
+  // all interfaces do for devices that drivers take.
+  for (uint8_t i = 0; i < conf->interfaces; ++i) {
+    const struct usb_host_interface* intf = &conf->interface[i];
+    setup_endpoints(hub, intf);
+    if (!bound_driver[hub] && select_hid_interface(hub, intf)) {
+      break;
     }
-    offset += head->bLength;
   }
-  delay_ms(hub, 5, STATE_SET_CONFIGURATION);
-  return false;
+  // Strings are fetched after the configuration so that the core part can
+  // identify known devices, and skip remaining descriptors.
+  cached[hub] =
+      !bound_driver[hub] && usb_host->is_cached && usb_host->is_cached(hub);
+  unlock_transaction(hub);
+  uint8_t i;
+  if (cached[hub] || !find_string_index(hub, &i)) {
+    return delay_ms(hub, timing->settle_ms, STATE_SET_CONFIGURATION);
+  }
+  desc_length[hub] = 2;
+  return delay_us(hub, timing->request_gap_us, STATE_GET_STRING_DESC);
 }
 
 static bool state_set_configuration(uint8_t hub) {
+  if (!lock_device(hub)) {
+    return false;
+  }
+  set_configuration_descriptor.wValue = configuration_value[hub];
   host_setup_transfer(hub, (uint8_t*)&set_configuration_descriptor,
                       sizeof(set_configuration_descriptor),
                       STATE_SET_CONFIGURATION_DONE);
@@ -568,8 +1070,8 @@ static bool state_set_configuration(uint8_t hub) {
 }
 
 static bool state_set_configuration_done(uint8_t hub) {
-  delay_us(hub, 1000, STATE_SET_FEATURE);
-  return false;
+  unlock_transaction(hub);
+  return delay_us(hub, timing->request_gap_us, STATE_SET_FEATURE);
 }
 
 static bool state_set_feature(uint8_t hub) {
@@ -579,6 +1081,9 @@ static bool state_set_feature(uint8_t hub) {
     state[hub] = next_state;
     return true;
   }
+  if (!lock_device(hub)) {
+    return false;
+  }
   do_not_retry[hub] = true;
   host_setup_transfer(hub, (uint8_t*)&set_feature_descriptor,
                       sizeof(set_feature_descriptor), next_state);
@@ -586,14 +1091,23 @@ static bool state_set_feature(uint8_t hub) {
 }
 
 static bool state_extra_setup(uint8_t hub) {
-  delay_us(hub, 1000,
-           hub_ports[hub]                          ? STATE_GET_HUB_DESC
-           : (hid_boot[hub] != BOOT_NOT_SUPPORTED) ? STATE_HID_SET_PROTOCOL
-                                                   : STATE_GET_HID_REPORT_DESC);
-  return false;
+  unlock_transaction(hub);
+  desc_length[hub] = 0x0008;  // Hub descriptor core part.
+  return delay_us(hub, timing->request_gap_us,
+                  hub_ports[hub] ? STATE_GET_HUB_DESC
+                  : (hid_boot[hub] != BOOT_NOT_SUPPORTED)
+                      ? STATE_HID_SET_PROTOCOL
+                  : (cached[hub] || bound_driver[hub]) ? STATE_DONE
+                                : STATE_GET_HID_REPORT_DESC);
 }
 
 static bool state_get_hid_report_desc(uint8_t hub) {
+  if (!lock_device(hub)) {
+    return false;
+  }
+  get_hid_report_descriptor.wIndex = hid_report_desc_interface[hub];
+  get_hid_report_descriptor.wLength = hid_report_desc_length[hub];
+  transaction_stream = true;
   host_setup_transfer(hub, (uint8_t*)&get_hid_report_descriptor,
                       sizeof(get_hid_report_descriptor),
                       STATE_GET_HID_REPORT_DESC_RECV);
@@ -601,15 +1115,21 @@ static bool state_get_hid_report_desc(uint8_t hub) {
 }
 
 static bool state_get_hid_report_desc_recv(uint8_t hub) {
+  if (transaction_result == USB_HOST_RESULT_OK) {
+    stream_packet(hub);
+  }
   if (usb_host->check_hid_report_desc) {
-    usb_host->check_hid_report_desc(hub, buffer);
+    usb_host->check_hid_report_desc(hub, stream_offset, buffer, 0);
   }
   unlock_transaction(hub);
-  delay_ms(hub, 5, STATE_READY);
-  return false;
+  finish_enumeration(hub);
+  return delay_ms(hub, timing->settle_ms, STATE_READY);
 }
 
 static bool state_hid_set_protocol(uint8_t hub) {
+  if (!lock_device(hub)) {
+    return false;
+  }
   // Select boot protocol or report protocol.
   hid_set_protocol.wValue = (hid_boot[hub] == BOOT_SELECTED) ? 0 : 1;
   host_setup_transfer(hub, (uint8_t*)&hid_set_protocol,
@@ -618,13 +1138,18 @@ static bool state_hid_set_protocol(uint8_t hub) {
 }
 
 static bool state_hid_set_protocol_done(uint8_t hub) {
-  delay_ms(hub, 5,
-           (hid_boot[hub] == BOOT_SELECTED) ? STATE_DONE
-                                            : STATE_GET_HID_REPORT_DESC);
-  return false;
+  unlock_transaction(hub);
+  return delay_ms(hub, timing->settle_ms,
+                  (hid_boot[hub] == BOOT_SELECTED || cached[hub])
+                      ? STATE_DONE
+                      : STATE_GET_HID_REPORT_DESC);
 }
 
 static bool state_get_hub_desc(uint8_t hub) {
+  if (!lock_device(hub)) {
+    return false;
+  }
+  get_hub_descriptor.wLength = desc_length[hub];
   host_setup_transfer(hub, (uint8_t*)&get_hub_descriptor,
                       sizeof(get_hub_descriptor), STATE_GET_HUB_DESC_RECV);
   return false;
@@ -632,24 +1157,35 @@ static bool state_get_hub_desc(uint8_t hub) {
 
 static bool state_get_hub_desc_recv(uint8_t hub) {
   const struct usb_desc_hub* desc = (const struct usb_desc_hub*)buffer;
-  if (get_hub_descriptor.wLength != desc->bDescLength) {
+  unlock_transaction(hub);
+  if (desc_length[hub] != desc->bDescLength) {
     // Request full part.
-    get_hub_descriptor.wLength = desc->bDescLength;
-    delay_us(hub, 500, STATE_GET_HUB_DESC);
-    return false;
+    desc_length[hub] = desc->bDescLength;
+    // Hubs have been asked again in half the gap of other requests.
+    return delay_us(hub, timing->request_gap_us / 2, STATE_GET_HUB_DESC);
   }
   hub_ports[hub] = desc->bNbPorts;
-  set_port_power_feature.wIndex = 1;  // port index originated from 1.
-  delay_ms(hub, 5, STATE_SET_PORT_POWER_FEATURE);
-  return false;
+  setup_port[hub] = 1;  // port index originated from 1.
+  return delay_ms(hub, timing->settle_ms, STATE_SET_PORT_POWER_FEATURE);
 }
 
 static bool state_set_port_power_feature(uint8_t hub) {
-  if (set_port_power_feature.wIndex > hub_ports[hub]) {
-    clear_port_connection_feature.wIndex = 1;  // port index originated from 1.
-    delay_ms(hub, 5, STATE_CLEAR_PORT_CONNECTION_FEATURE);
+  if (setup_port[hub] > hub_ports[hub]) {
+#if HUB_DRIVER
+    // Keep connection changes so that the hub driver can find devices that
+    // are already connected.
+    state[hub] = STATE_DONE;
+    return true;
+#else
+    setup_port[hub] = 1;  // port index originated from 1.
+    return delay_ms(hub, timing->settle_ms,
+                    STATE_CLEAR_PORT_CONNECTION_FEATURE);
+#endif
+  }
+  if (!lock_device(hub)) {
     return false;
   }
+  set_port_power_feature.wIndex = setup_port[hub];
   host_setup_transfer(hub, (uint8_t*)&set_port_power_feature,
                       sizeof(set_port_power_feature),
                       STATE_SET_PORT_POWER_FEATURE_DONE);
@@ -657,16 +1193,20 @@ static bool state_set_port_power_feature(uint8_t hub) {
 }
 
 static bool state_set_port_power_feature_done(uint8_t hub) {
-  set_port_power_feature.wIndex++;
-  delay_ms(hub, 5, STATE_SET_PORT_POWER_FEATURE);
-  return false;
+  unlock_transaction(hub);
+  setup_port[hub]++;
+  return delay_ms(hub, timing->settle_ms, STATE_SET_PORT_POWER_FEATURE);
 }
 
 static bool state_clear_port_connection_feature(uint8_t hub) {
-  if (clear_port_connection_feature.wIndex > hub_ports[hub]) {
+  if (setup_port[hub] > hub_ports[hub]) {
     state[hub] = STATE_DONE;
     return true;
   }
+  if (!lock_device(hub)) {
+    return false;
+  }
+  clear_port_connection_feature.wIndex = setup_port[hub];
   host_setup_transfer(hub, (uint8_t*)&clear_port_connection_feature,
                       sizeof(clear_port_connection_feature),
                       STATE_CLEAR_PORT_CONNECTION_FEATURE_DONE);
@@ -674,25 +1214,200 @@ static bool state_clear_port_connection_feature(uint8_t hub) {
 }
 
 static bool state_clear_port_connection_feature_done(uint8_t hub) {
-  clear_port_connection_feature.wIndex++;
-  delay_ms(hub, 5, STATE_CLEAR_PORT_CONNECTION_FEATURE);
+  unlock_transaction(hub);
+  setup_port[hub]++;
+  return delay_ms(hub, timing->settle_ms,
+                  STATE_CLEAR_PORT_CONNECTION_FEATURE);
+}
+
+#if HUB_DRIVER
+static void detach(uint8_t hub);
+
+// Returns 0 if no device is attached to the port as root ports can not be
+// behind hubs.
+static uint8_t find_device(uint8_t hub, uint8_t port) {
+  for (uint8_t i = 2; i < USB_HOST_MAX_DEVICES; ++i) {
+    if (parent[i] == hub && parent_port[i] == port)
+      return i;
+  }
+  return 0;
+}
+
+static void attach(uint8_t hub, uint8_t port, bool is_low_speed) {
+  for (uint8_t i = 2; i < USB_HOST_MAX_DEVICES; ++i) {
+    if (parent[i] != NO_PARENT)
+      continue;
+    parent[i] = hub;
+    parent_port[i] = port;
+    low_speed[i] = is_low_speed;
+    hub_address[i] = 0;
+    hub_ports[i] = 0;
+    quirks[i] = 0;
+    halt_retry[i] = 0;
+    initial_check[i] = true;
+    start_enumeration(i);
+    // The reset device takes over the address 0 that the hub claimed.
+    address0_owner = i;
+    // Wait for the reset recovery.
+    delay_ms(i, timing->enable_ms, STATE_GET_DEVICE_DESC);
+    return;
+  }
+  // No room. The port stays enabled but is not used.
+  release_address0(hub);
+}
+
+static void send_hub_port_request(uint8_t hub,
+                                  uint8_t request,
+                                  uint8_t feature) {
+  hub_port_request.bRequestType =
+      USB_REQ_DIR_OUT | USB_REQ_TYPE_CLASS | USB_REQ_RECPT_OTHER;
+  hub_port_request.bRequest = request;
+  hub_port_request.wValue = feature;
+  hub_port_request.wIndex = hub_port[hub];
+  hub_port_request.wLength = 0;
+  host_setup_transfer(hub, (uint8_t*)&hub_port_request,
+                      sizeof(hub_port_request), STATE_HUB_PORT_REQUEST_DONE);
+}
+
+static bool state_hub_poll(uint8_t hub) {
+  if (!lock_transaction(hub, get_device_address(hub))) {
+    return false;
+  }
+  start_poll_interval(hub, hub_ep[hub]);
+  // Ask the status change endpoint for a bitmap of changed ports.
+  transaction_stage = 2;
+  do_not_retry[hub] = true;
+  user_request_size = ep_max_packet_size[hub][hub_ep[hub]];
+  host_in_transfer(hub, hub_ep[hub], buffer, user_request_size,
+                   STATE_HUB_POLL_RECV, 0);
   return false;
 }
 
-static bool state_done(uint8_t hub) {
+static bool state_hub_poll_recv(uint8_t hub) {
   unlock_transaction(hub);
-  delay_ms(hub, 5, STATE_READY);
+  do_not_retry[hub] = false;
+  if (transaction_result == USB_HOST_RESULT_OK) {
+    uint16_t size = user_request_size - transaction_size;
+    for (uint8_t port = 1; port <= hub_ports[hub] && (port >> 3) < size;
+         ++port) {
+      if (buffer[port >> 3] & (1 << (port & 7))) {
+        hub_port[hub] = port;
+        state[hub] = STATE_HUB_GET_PORT_STATUS;
+        return true;
+      }
+    }
+  }
+  uint8_t interval = ep_interval[hub][hub_ep[hub]];
+  return delay_ms(hub, interval ? interval : HUB_POLL_INTERVAL_MS,
+                  STATE_HUB_POLL);
+}
+
+static bool state_hub_get_port_status(uint8_t hub) {
+  if (!lock_transaction(hub, get_device_address(hub))) {
+    return false;
+  }
+  hub_port_request.bRequestType =
+      USB_REQ_DIR_IN | USB_REQ_TYPE_CLASS | USB_REQ_RECPT_OTHER;
+  hub_port_request.bRequest = USB_GET_STATUS;
+  hub_port_request.wValue = 0;
+  hub_port_request.wIndex = hub_port[hub];
+  hub_port_request.wLength = 4;
+  host_setup_transfer(hub, (uint8_t*)&hub_port_request,
+                      sizeof(hub_port_request), STATE_HUB_GET_PORT_STATUS_RECV);
+  return false;
+}
+
+static bool state_hub_get_port_status_recv(uint8_t hub) {
+  if (transaction_result != USB_HOST_RESULT_OK) {
+    unlock_transaction(hub);
+    return delay_ms(hub, HUB_POLL_INTERVAL_MS, STATE_HUB_POLL);
+  }
+  uint16_t status = buffer[0] | (buffer[1] << 8);
+  uint8_t change = buffer[2];
+  // Acknowledge changes one by one. C_PORT_* features are ordered as bits.
+  for (uint8_t i = 0; i < 5; ++i) {
+    if (change & (1 << i)) {
+      send_hub_port_request(hub, USB_CLEAR_FEATURE,
+                            USB_FEATURE_C_PORT_CONNECTION + i);
+      return false;
+    }
+  }
+  uint8_t device = find_device(hub, hub_port[hub]);
+  if (!(status & USB_HUB_PORT_CONNECTION)) {
+    unlock_transaction(hub);
+    release_address0(hub);
+    hub_port_debounced[hub] = false;
+    if (device) {
+      detach(device);
+    }
+    state[hub] = STATE_HUB_POLL;
+    return true;
+  }
+  if (device) {
+    unlock_transaction(hub);
+    state[hub] = STATE_HUB_POLL;
+    return true;
+  }
+  if (status & USB_HUB_PORT_RESET) {
+    // Still resetting.
+    unlock_transaction(hub);
+    return delay_ms(hub, timing->enable_ms, STATE_HUB_GET_PORT_STATUS);
+  }
+  if (status & USB_HUB_PORT_ENABLE) {
+    // Reset is done.
+    unlock_transaction(hub);
+    hub_port_debounced[hub] = false;
+    attach(hub, hub_port[hub], status & USB_HUB_PORT_LOW_SPEED);
+    state[hub] = STATE_HUB_POLL;
+    return true;
+  }
+  if (!hub_port_debounced[hub] || !claim_address0(hub)) {
+    // Wait for the device to be stable, or other devices to get addresses.
+    unlock_transaction(hub);
+    hub_port_debounced[hub] = true;
+    return delay_ms(hub, timing->attach_ms, STATE_HUB_GET_PORT_STATUS);
+  }
+  send_hub_port_request(hub, USB_SET_FEATURE, USB_FEATURE_PORT_RESET);
   return false;
 }
 
+static bool state_hub_port_request_done(uint8_t hub) {
+  bool reset = hub_port_request.bRequest == USB_SET_FEATURE;
+  unlock_transaction(hub);
+  if (reset) {
+    return delay_ms(hub, timing->enable_ms, STATE_HUB_GET_PORT_STATUS);
+  }
+  state[hub] = STATE_HUB_GET_PORT_STATUS;
+  return true;
+}
+#endif  // HUB_DRIVER
+
+static bool state_done(uint8_t hub) {
+  unlock_transaction(hub);
+  finish_enumeration(hub);
+#if HUB_DRIVER
+  if (hub_ports[hub]) {
+    return delay_ms(hub, timing->settle_ms, STATE_HUB_POLL);
+  }
+#endif
+  return delay_ms(hub, timing->settle_ms, STATE_READY);
+}
+
 static bool state_ready(uint8_t hub) {
   hub;
   return false;
 }
 
 static bool state_in_recv(uint8_t hub) {
-  if (usb_host->in)
-    usb_host->in(hub, buffer, user_request_size - transaction_size);
+  uint16_t size = user_request_size - transaction_size;
+  if (transaction_result != USB_HOST_RESULT_OK) {
+    // Partial data of failed or canceled transfers is not delivered.
+  } else if (bound_driver[hub]) {
+    if (bound_driver[hub]->report)
+      bound_driver[hub]->report(hub, buffer, size);
+  } else if (usb_host->in) {
+    usb_host->in(hub, buffer, size);
+  }
   do_not_retry[hub] = false;
   unlock_transaction(hub);
   delay_us(hub, 250, STATE_READY);
@@ -707,7 +1422,8 @@ static bool state_out_done(uint8_t hub) {
 
 static bool state_hid_get_report(uint8_t hub) {
   uint16_t size = user_request_size - transaction_size;
-  if (usb_host->hid_report && !do_not_retry[hub]) {
+  if (usb_host->hid_report && !do_not_retry[hub] &&
+      transaction_result == USB_HOST_RESULT_OK) {
     usb_host->hid_report(hub, buffer, size);
   }
   do_not_retry[hub] = false;
@@ -716,6 +1432,40 @@ static bool state_hid_get_report(uint8_t hub) {
   return false;
 }
 
+static void dispatch(void);
+
+static bool state_request_done(uint8_t hub) {
+  struct usb_host_request* request = active_request[hub];
+  uint8_t result = transaction_result;
+  uint8_t* data = request->data;
+  uint16_t size = request->size;
+  if (request->type == USB_HOST_REQ_IN ||
+      request->type == USB_HOST_REQ_BULK_IN) {
+    if (!data)
+      data = buffer;
+    size = user_request_size - transaction_size;
+  } else if (request->type == USB_HOST_REQ_SETUP &&
+             (request->setup->bRequestType & USB_REQ_DIR_MASK) ==
+                 USB_REQ_DIR_IN) {
+    data = buffer;
+    size = user_request_size - transaction_size;
+  }
+  if (result != USB_HOST_RESULT_OK) {
+    size = 0;
+  }
+  active_request[hub] = 0;
+  do_not_retry[hub] = false;
+  state[hub] = STATE_READY;
+  // Keep the transaction locked so that the shared buffer stays intact while
+  // the callback runs.
+  request->complete(hub, request->context, result, data, size);
+  unlock_transaction(hub);
+  // Requests queued while this one was in flight start without waiting for
+  // the next usb_host_poll().
+  dispatch();
+  return false;
+}
+
 static bool state_delay_us(uint8_t hub) {
   if (timer3_tick_raw_between(delay_begin[hub], delay_end[hub]))
     return false;
@@ -739,32 +1489,80 @@ static bool state_transaction(uint8_t hub) {
 
   uint8_t pid = transaction_ep_pid >> 4;
   uint8_t token = USB_INT_ST & MASK_UIS_HRES;
-  if (pid == USB_PID_IN && token != USB_PID_NAK && token != USB_PID_STALL) {
+  stats[hub].transactions++;
+  bool has_data =
+      pid == USB_PID_IN && token != USB_PID_NAK && token != USB_PID_STALL;
+#ifdef _USB_HOST_TRACE
+  trace_packet(hub, token, has_data ? USB_RX_LEN : 0,
+               rx_direct ? transaction_buffer : rx_buffer);
+#endif  // _USB_HOST_TRACE
+  if (is_toggle_tracked() && has_data && !U_TOG_OK) {
+    if (++toggle_drops < TOGGLE_DROP_LIMIT) {
+      // The device resent the last packet as it missed our ACK. Drop it.
+      state[hub] = STATE_TRANSACTION_CONT;
+      return true;
+    }
+    // The device lost the toggle, e.g. on a reset that the host did not see.
+    // Take the packet, and follow the toggle that it sent.
+    flip_toggle(hub);
+  }
+  // Set if the device sent more than the transfer expects.
+  bool babble = false;
+  if (has_data) {
     uint16_t size = USB_RX_LEN;
-    for (uint16_t i = 0; i < size; ++i)
-      transaction_buffer[i] = rx_buffer[i];
+    if (size > transaction_size) {
+      // Never write past the destination, e.g. the shared buffer.
+      size = transaction_size;
+      babble = true;
+    }
+    if (!rx_direct) {
+      for (uint16_t i = 0; i < size; ++i)
+        transaction_buffer[i] = rx_buffer[i];
+    }
 #ifdef _USB_HOST_DBG_LOG
     usb_host_log_recv(transaction_ep_pid & 0x0f, transaction_ep_pid >> 4, size,
                       transaction_buffer);
 #endif  // _USB_HOST_DBG_LOG
     transaction_buffer = &transaction_buffer[size];
     transaction_size -= size;
+    stream_size = size;
   }
 
   if (token == USB_PID_STALL) {
 #ifdef _USB_HOST_DBG_LOG
     usb_host_log_stall();
 #endif  // _USB_HOST_DBG_LOG
+    stats[hub].stalls++;
+    complete_transfer(hub, USB_HOST_RESULT_STALL);
     unlock_transaction(hub);
     buffer[0] = 0;  // bLength = 0
-    state[hub] = transaction_recv_state;
     return true;
   } else if (U_TOG_OK || token == USB_PID_DATA0 || token == USB_PID_DATA1 ||
              token == 0) {
-    if (transaction_size &&
-        USB_RX_LEN == ep_max_packet_size[hub][transaction_ep_pid & 0x0f]) {
-      delay_us(hub, 250, STATE_TRANSACTION_CONT);
-      return false;
+    if (is_toggle_tracked())
+      flip_toggle(hub);
+    if (babble && is_toggle_tracked()) {
+      // Control transfers keep the data that fits, as descriptors are read.
+      complete_transfer(hub, USB_HOST_RESULT_BABBLE);
+      return true;
+    }
+    if (transaction_bulk) {
+      if (transaction_size &&
+          (pid == USB_PID_OUT ||
+           USB_RX_LEN == ep_max_packet_size[hub][transaction_ep_pid & 0x0f])) {
+        // Packets follow back to back till a short packet ends the transfer.
+        state[hub] = STATE_TRANSACTION_CONT;
+        return true;
+      }
+    } else if (transaction_size &&
+               USB_RX_LEN ==
+                   ep_max_packet_size[hub][transaction_ep_pid & 0x0f]) {
+      if (transaction_stream) {
+        // Parsers run in usb_host_poll().
+        state[hub] = STATE_TRANSACTION_STREAM;
+        return false;
+      }
+      return delay_us(hub, stage_gap_us(hub, 250), STATE_TRANSACTION_CONT);
     }
 
     // Succeeded.
@@ -774,14 +1572,13 @@ static bool state_transaction(uint8_t hub) {
       if ((req->bRequestType & USB_REQ_DIR_MASK) == USB_REQ_DIR_IN) {
         pid = USB_PID_IN;
         if (req->wLength) {
-          delay_us(hub, 500, STATE_TRANSACTION_IN);
-          return false;
+          return delay_us(hub, stage_gap_us(hub, 500), STATE_TRANSACTION_IN);
         }
       } else if ((req->bRequestType & USB_REQ_DIR_MASK) == USB_REQ_DIR_OUT) {
         pid = USB_PID_OUT;
         if (req->wLength) {
-          delay_us(hub, 500, STATE_TRANSACTION_OUT);
-          return false;
+          return delay_us(hub, stage_gap_us(hub, 500),
+                          STATE_TRANSACTION_OUT);
         }
       }
     }
@@ -789,23 +1586,31 @@ static bool state_transaction(uint8_t hub) {
       // Proceed status stage.
       transaction_stage++;
       if (pid == USB_PID_IN) {
-        delay_us(hub, 250, STATE_TRANSACTION_OUT);
-        return false;
+        return delay_us(hub, stage_gap_us(hub, 250), STATE_TRANSACTION_OUT);
       } else if (pid == USB_PID_OUT) {
-        delay_us(hub, 250, STATE_TRANSACTION_IN);
-        return false;
+        return delay_us(hub, stage_gap_us(hub, 250), STATE_TRANSACTION_IN);
       }
     }
-    state[hub] = transaction_recv_state;
+    complete_transfer(hub, USB_HOST_RESULT_OK);
     do_not_retry[hub] = false;
     return true;
   } else if (token == USB_PID_NAK) {
 #ifdef _USB_HOST_DBG_LOG
     usb_host_log_nak();
 #endif  // _USB_HOST_DBG_LOG
+    stats[hub].naks++;
     if (do_not_retry[hub] == true) {
       // Keeping `do_not_retry` means it fails with NAK.
-      state[hub] = transaction_recv_state;
+      complete_transfer(hub, USB_HOST_RESULT_NAK);
+      return true;
+    }
+    if (is_transfer_timed_out()) {
+      stats[hub].timeouts++;
+      if (enumerating[hub]) {
+        halt(hub);
+        return false;
+      }
+      complete_transfer(hub, USB_HOST_RESULT_TIMEOUT);
       return true;
     }
     delay_us(hub, 250, STATE_TRANSACTION_RETRY);
@@ -822,7 +1627,8 @@ static bool state_transaction_in(uint8_t hub) {
   const uint8_t ep = transaction_ep_pid & 0x0f;
   user_request_size = (transaction_stage == 1) ? 0 : req->wLength;
   uint8_t tog = (transaction_stage == 1) ? AUTO_TOGGLE : 0;
-  host_in_transfer(hub, ep, user_request_size, transaction_recv_state, tog);
+  host_in_transfer(hub, ep, buffer, user_request_size, transaction_recv_state,
+                   tog);
   return false;
 }
 
@@ -846,15 +1652,209 @@ static bool state_transaction_cont(uint8_t hub) {
   return false;
 }
 
+static bool state_transaction_stream(uint8_t hub) {
+  stream_packet(hub);
+  transaction_buffer = buffer;
+  return delay_us(hub, stage_gap_us(hub, 250), STATE_TRANSACTION_CONT);
+}
+
 static bool state_transaction_retry(uint8_t hub) {
+  stats[hub].retries++;
+  state[hub] = STATE_TRANSACTION;
   UH_EP_PID = transaction_ep_pid;
   UIF_TRANSFER = 0;
-  state[hub] = STATE_TRANSACTION;
   return false;
 }
 
+// Runs states that only drive the bus and never call back to the user.
+static bool transaction_fsm(uint8_t hub) {
+  switch (state[hub]) {
+    case STATE_TRANSACTION:
+      return state_transaction(hub);
+    case STATE_TRANSACTION_IN:
+      return state_transaction_in(hub);
+    case STATE_TRANSACTION_OUT:
+      return state_transaction_out(hub);
+    case STATE_TRANSACTION_ACK:
+      return state_transaction_ack(hub);
+    case STATE_TRANSACTION_CONT:
+      return state_transaction_cont(hub);
+    case STATE_TRANSACTION_RETRY:
+      return state_transaction_retry(hub);
+  }
+  return false;
+}
+
+static void flush_requests(uint8_t hub) {
+  struct usb_host_request* request = active_request[hub];
+  active_request[hub] = 0;
+  if (request) {
+    request->complete(hub, request->context, USB_HOST_RESULT_DISCONNECTED, 0,
+                      0);
+  }
+  while (queue_count[hub]) {
+    request = queue[hub][queue_head[hub]];
+    queue_head[hub] = (queue_head[hub] + 1) % USB_HOST_QUEUE_SIZE;
+    queue_count[hub]--;
+    request->complete(hub, request->context, USB_HOST_RESULT_DISCONNECTED, 0,
+                      0);
+  }
+}
+
+// Stops the device and devices behind it, and notifies the disconnection.
+static void detach(uint8_t hub) {
+#if HUB_DRIVER
+  for (uint8_t i = 2; i < USB_HOST_MAX_DEVICES; ++i) {
+    if (parent[i] == hub)
+      detach(i);
+  }
+#endif
+  state[hub] = STATE_IDLE;
+  enumerating[hub] = false;
+  unlock_transaction(hub);
+  release_address0(hub);
+  flush_requests(hub);
+  if (bound_driver[hub]) {
+    if (bound_driver[hub]->disconnected)
+      bound_driver[hub]->disconnected(hub);
+    bound_driver[hub] = 0;
+  }
+  // The halt backoff already detached the device if it is unplugged during
+  // the backoff.
+  if (attached[hub] && usb_host->disconnected)
+    usb_host->disconnected(hub);
+  attached[hub] = false;
+  if (hub >= 2)
+    parent[hub] = NO_PARENT;
+}
+
+// Resets the root port to recover the device with an exponential backoff.
+// Devices behind hubs stay halted.
+static bool state_halt(uint8_t hub) {
+  if (halt_retry[hub] > USB_HOST_HALT_RETRIES)
+    return false;
+  if (hub >= 2 || halt_retry[hub] == USB_HOST_HALT_RETRIES) {
+    halt_retry[hub] = USB_HOST_HALT_RETRIES + 1;
+    if (usb_host->halted)
+      usb_host->halted(hub, 0);
+    return false;
+  }
+  uint16_t backoff = USB_HOST_HALT_BACKOFF_MS << halt_retry[hub];
+  halt_retry[hub]++;
+  if (usb_host->halted)
+    usb_host->halted(hub, halt_retry[hub]);
+  detach(hub);
+  if (!hub) {
+    UHUB0_CTRL = 0x00;
+  } else {
+    UHUB1_CTRL = 0x00;
+  }
+  return delay_ms(hub, backoff, STATE_CONNECT);
+}
+
+// Returns the priority of the request at the head of the device queue.
+static uint8_t head_priority(uint8_t hub) {
+  if (!queue_count[hub] || !usb_host_ready(hub)) {
+    return PRIORITY_NONE;
+  }
+  struct usb_host_request* request = queue[hub][queue_head[hub]];
+  if (request->type != USB_HOST_REQ_IN) {
+    return PRIORITY_BACKGROUND;
+  }
+  if (!is_poll_due(hub, request->ep)) {
+    // Keep the bus for others until the next interval comes.
+    return PRIORITY_NONE;
+  }
+  return ep_interval[hub][request->ep & 0x0f] ? PRIORITY_PERIODIC
+                                              : PRIORITY_BACKGROUND;
+}
+
+static bool start_request(uint8_t hub) {
+  IE_USB = 0;
+  struct usb_host_request* request = queue[hub][queue_head[hub]];
+  if (!lock_transaction(hub, get_device_address(hub))) {
+    if (use_interrupt())
+      IE_USB = 1;
+    return false;
+  }
+  queue_head[hub] = (queue_head[hub] + 1) % USB_HOST_QUEUE_SIZE;
+  queue_count[hub]--;
+  active_request[hub] = request;
+  if (use_interrupt())
+    IE_USB = 1;
+  if (request->timeout_ms)
+    transfer_timeout_ms = request->timeout_ms;
+  if (request->type == USB_HOST_REQ_SETUP) {
+    do_not_retry[hub] = false;
+    if ((request->setup->bRequestType & USB_REQ_DIR_MASK) ==
+        USB_REQ_DIR_OUT) {
+      for (uint16_t i = 0; i < request->size; ++i)
+        buffer[i] = request->data[i];
+    }
+    host_setup_transfer(hub, (uint8_t*)request->setup,
+                        sizeof(struct usb_setup_req), STATE_REQUEST_DONE);
+  } else if (request->type == USB_HOST_REQ_BULK_IN ||
+             request->type == USB_HOST_REQ_BULK_OUT) {
+    transaction_stage = 2;
+    transaction_bulk = true;
+    do_not_retry[hub] = false;
+    if (request->type == USB_HOST_REQ_BULK_IN) {
+      user_request_size = request->size;
+      host_in_transfer(hub, request->ep, request->data, request->size,
+                       STATE_REQUEST_DONE, 0);
+    } else {
+      host_out_transfer(hub, request->ep, request->data, request->size,
+                        STATE_REQUEST_DONE, 0);
+    }
+  } else if (request->type == USB_HOST_REQ_IN) {
+    transaction_stage = 2;
+    do_not_retry[hub] = true;
+    user_request_size = request->size;
+    start_poll_interval(hub, request->ep);
+    host_in_transfer(hub, request->ep, request->data ? request->data : buffer,
+                     request->size, STATE_REQUEST_DONE, 0);
+  } else {
+    transaction_stage = 2;
+    host_out_transfer(hub, request->ep, request->data, request->size,
+                      STATE_REQUEST_DONE, 0);
+  }
+  return true;
+}
+
+// Starts a queued request while the bus is free. Periodic requests win over
+// others, and the one that has been due longest goes first. Devices take turns
+// on ties so that all of them keep the bus busy.
+static void dispatch(void) {
+  uint8_t best_hub = 0;
+  uint8_t best_priority = PRIORITY_NONE;
+  uint16_t best_lateness = 0;
+  for (uint8_t i = 0; i < USB_HOST_MAX_DEVICES; ++i) {
+    uint8_t hub = (next_dispatch_hub + i) % USB_HOST_MAX_DEVICES;
+    uint8_t priority = head_priority(hub);
+    if (priority == PRIORITY_NONE || priority < best_priority)
+      continue;
+    uint16_t lateness =
+        (priority == PRIORITY_PERIODIC)
+            ? poll_lateness(hub, queue[hub][queue_head[hub]]->ep)
+            : 0;
+    if (priority == best_priority && lateness <= best_lateness)
+      continue;
+    best_hub = hub;
+    best_priority = priority;
+    best_lateness = lateness;
+  }
+  if (best_priority == PRIORITY_NONE ||
+      (best_priority == PRIORITY_BACKGROUND && yields_to_periodic(best_hub))) {
+    return;
+  }
+  if (start_request(best_hub))
+    next_dispatch_hub = (best_hub + 1) % USB_HOST_MAX_DEVICES;
+}
+
 static bool fsm(uint8_t hub) {
-  if (state[hub] != STATE_IDLE && !resetting[hub]) {
+  if (hub < 2 && state[hub] != STATE_IDLE && !resetting[hub]) {
+    // The interrupt handler should not update the state being detached.
+    IE_USB = 0;
     if (hub == 0 && (USB_HUB_ST & bUHS_H0_ATTACH) == 0) {
       UHUB0_CTRL = 0x00;
       state[hub] = STATE_IDLE;
@@ -866,10 +1866,10 @@ static bool fsm(uint8_t hub) {
     if (state[hub] == STATE_IDLE) {
       UH_EP_PID = 0;  // Stop USB transaction.
       USB_CTRL = bUC_HOST_MODE | bUC_INT_BUSY | bUC_DMA_EN;
-      if (usb_host->disconnected)
-        usb_host->disconnected(hub);
-      unlock_transaction(hub);
+      detach(hub);
     }
+    if (use_interrupt())
+      IE_USB = 1;
   }
   switch (state[hub]) {
     case STATE_IDLE:
@@ -924,40 +1924,102 @@ static bool fsm(uint8_t hub) {
       return state_clear_port_connection_feature(hub);
     case STATE_CLEAR_PORT_CONNECTION_FEATURE_DONE:
       return state_clear_port_connection_feature_done(hub);
+#if HUB_DRIVER
+    case STATE_HUB_POLL:
+      return state_hub_poll(hub);
+    case STATE_HUB_POLL_RECV:
+      return state_hub_poll_recv(hub);
+    case STATE_HUB_GET_PORT_STATUS:
+      return state_hub_get_port_status(hub);
+    case STATE_HUB_GET_PORT_STATUS_RECV:
+      return state_hub_get_port_status_recv(hub);
+    case STATE_HUB_PORT_REQUEST_DONE:
+      return state_hub_port_request_done(hub);
+#endif
     case STATE_DONE:
       return state_done(hub);
     case STATE_READY:
       return state_ready(hub);
     case STATE_HALT:
-      return false;
+      return state_halt(hub);
     case STATE_IN_RECV:
       return state_in_recv(hub);
     case STATE_OUT_DONE:
       return state_out_done(hub);
     case STATE_HID_GET_REPORT:
       return state_hid_get_report(hub);
+    case STATE_REQUEST_DONE:
+      return state_request_done(hub);
     case STATE_DELAY_US:
       return state_delay_us(hub);
     case STATE_DELAY_MS:
       return state_delay_ms(hub);
     case STATE_TRANSACTION:
+      if (use_interrupt()) {
+        // usb_host_int() takes the completion.
+        return false;
+      }
       return state_transaction(hub);
     case STATE_TRANSACTION_IN:
-      return state_transaction_in(hub);
     case STATE_TRANSACTION_OUT:
-      return state_transaction_out(hub);
     case STATE_TRANSACTION_ACK:
-      return state_transaction_ack(hub);
     case STATE_TRANSACTION_CONT:
-      return state_transaction_cont(hub);
     case STATE_TRANSACTION_RETRY:
-      return state_transaction_retry(hub);
+      return transaction_fsm(hub);
+    case STATE_TRANSACTION_STREAM:
+      return state_transaction_stream(hub);
     default:
       halt(hub);
   }
   return false;
 }
 
+#ifdef _USB_HOST_INTERRUPT
+void usb_host_int(void) __interrupt(INT_NO_USB) __using(1) {
+  if (UIF_DETECT) {
+    // Attachments are checked in usb_host_poll() via USB_HUB_ST.
+    UIF_DETECT = 0;
+  }
+  if (!UIF_TRANSFER) {
+    return;
+  }
+  if (is_transaction_locked()) {
+    uint8_t hub = transaction_lock;
+    if (state[hub] == STATE_TRANSACTION) {
+      // Take the completion, and issue following packets that do not need to
+      // wait, e.g. next stages, without waiting for the next poll. Callbacks
+      // still run in usb_host_poll().
+      while (transaction_fsm(hub))
+        ;
+      if (state[hub] == STATE_TRANSACTION) {
+        // Next transaction is on the fly.
+        return;
+      }
+    }
+  }
+  UIF_TRANSFER = 0;
+}
+#endif  // _USB_HOST_INTERRUPT
+
+#ifdef _USB_HOST_TRACE
+uint8_t usb_host_trace_drain(void (*send)(const uint8_t* data, uint8_t size)) {
+  static uint8_t frame[1 + sizeof(struct usb_host_trace)];
+  uint8_t count = 0;
+  frame[0] = USB_HOST_TRACE_MAGIC;
+  while (trace_read != trace_write) {
+    const uint8_t* record =
+        (const uint8_t*)&trace[trace_read & (USB_HOST_TRACE_SIZE - 1)];
+    for (uint8_t i = 0; i < sizeof(struct usb_host_trace); ++i)
+      frame[1 + i] = record[i];
+    // Free the entry before sending as it may take long.
+    trace_read++;
+    send(frame, sizeof(frame));
+    count++;
+  }
+  return count;
+}
+#endif  // _USB_HOST_TRACE
+
 #ifdef _IMPL_USB_HOST_LOG_SEND
 void usb_host_log_send(uint8_t ep, uint8_t pid, uint8_t size, uint8_t* buffer) {
   Serial.printf("send ep: %d, pid: %d, size: %d; ", ep, pid, size);
@@ -990,6 +2052,7 @@ void usb_host_log_nak(void) {
 
 void usb_host_init(struct usb_host* host) {
   usb_host = host;
+  timing = host->timing ? host->timing : &usb_host_timing_compatible;
 
   // DMA addresses must be even
   if ((uint16_t)rx_buffer & 1)
@@ -1021,10 +2084,17 @@ void usb_host_init(struct usb_host* host) {
   }
   USB_INT_EN = bUIE_TRANSFER | bUIE_DETECT;
 
-  for (uint8_t i = 0; i < 2; ++i)
+  for (uint8_t i = 0; i < USB_HOST_MAX_DEVICES; ++i) {
     state[i] = STATE_IDLE;
+    parent[i] = NO_PARENT;
+    hid_interface_number[i] = 0xff;
+  }
 
   timer3_tick_init();
+  frame_ms = timer3_tick_msec();
+
+  if (use_interrupt())
+    IE_USB = 1;  // Enable USB interrupts
 }
 
 void usb_host_reset(void) {
@@ -1045,13 +2115,54 @@ void usb_host_reset(void) {
   }
 }
 
+// Advances the frame number to the current ms tick. Returns true if a new frame
+// started.
+static bool update_frame(void) {
+  uint16_t elapsed = elapsed_ms(frame_ms);
+  if (!elapsed)
+    return false;
+  frame_ms = (frame_ms + elapsed) % 1000;
+  frame_number = (frame_number + elapsed) & USB_HOST_FRAME_MASK;
+  return true;
+}
+
+// Returns true if usb_host_poll() runs states of the device.
+static bool is_polled(uint8_t hub) {
+  if (hub == 0)
+    return usb_host->flags & USE_HUB0;
+  if (hub == 1)
+    return usb_host->flags & USE_HUB1;
+  return parent[hub] != NO_PARENT;
+}
+
 void usb_host_poll(void) {
-  if (usb_host->flags & USE_HUB0)
-    while (fsm(0))
-      ;
-  if (usb_host->flags & USE_HUB1)
-    while (fsm(1))
-      ;
+  usb_host_poll_budget(0);
+}
+
+bool usb_host_poll_budget(uint16_t max_ticks) {
+  uint16_t begin = timer3_tick_raw();
+  if (update_frame() && usb_host->frame)
+    usb_host->frame(frame_number);
+  bool busy;
+  do {
+    // Devices take one step in turn so that a long chain of states on one
+    // device does not use up the budget of others.
+    busy = false;
+    for (uint8_t i = 0; i < USB_HOST_MAX_DEVICES; ++i) {
+      if (is_polled(i) && fsm(i))
+        busy = true;
+    }
+    if (busy && max_ticks &&
+        !timer3_tick_raw_between(begin, begin + max_ticks)) {
+      return true;
+    }
+  } while (busy);
+  dispatch();
+  for (uint8_t i = 0; i < USB_HOST_MAX_DEVICES; ++i) {
+    if (state[i] == STATE_READY && bound_driver[i] && bound_driver[i]->poll)
+      bound_driver[i]->poll(i);
+  }
+  return false;
 }
 
 bool usb_host_ready(uint8_t hub) {
@@ -1065,8 +2176,9 @@ bool usb_host_idle(void) {
 bool usb_host_setup(uint8_t hub,
                     const struct usb_setup_req* req,
                     const uint8_t* data) {
-  if (!usb_host_ready(hub) ||
-      !lock_transaction(hub, hub_address[hub] ? hub_address[hub] : 1 + hub)) {
+  if (req->wLength > USB_HOST_BUFFER_SIZE || !usb_host_ready(hub) ||
+      yields_to_periodic(hub) ||
+      !lock_transaction(hub, get_device_address(hub))) {
     return false;
   }
   bool dir_in = (req->bRequestType & USB_REQ_DIR_MASK) == USB_REQ_DIR_IN;
@@ -1080,51 +2192,46 @@ bool usb_host_setup(uint8_t hub,
 }
 
 bool usb_host_in(uint8_t hub, uint8_t ep, uint8_t size) {
-  if (!usb_host_ready(hub) ||
-      !lock_transaction(hub, hub_address[hub] ? hub_address[hub] : 1 + hub)) {
+  if (size > USB_HOST_BUFFER_SIZE || !usb_host_ready(hub) ||
+      !is_poll_due(hub, ep) ||
+      !lock_transaction(hub, get_device_address(hub))) {
     return false;
   }
+  start_poll_interval(hub, ep);
   transaction_stage = 2;
   // Do not retry as hid returns NAK if the report isn't changed in idle state.
   // This flag keeps true if the request fails with NAK.
   do_not_retry[hub] = true;
   user_request_size = size;
-  host_in_transfer(hub, ep, size, STATE_IN_RECV, 0);
+  host_in_transfer(hub, ep, buffer, size, STATE_IN_RECV, 0);
   return true;
 }
 
 bool usb_host_in_data0(uint8_t hub, uint8_t ep, uint8_t size) {
-  if (!usb_host_ready(hub) ||
-      !lock_transaction(hub, hub_address[hub] ? hub_address[hub] : 1 + hub)) {
+  if (!usb_host_ready(hub))
     return false;
-  }
-  transaction_stage = 0;
-  // Do not retry as hid returns NAK if the report isn't changed in idle state.
-  // This flag keeps true if the request fails with NAK.
-  do_not_retry[hub] = true;
-  user_request_size = size;
-  host_in_transfer(hub, ep, size, STATE_IN_RECV, 0);
-  return true;
+  toggle_in[hub] &= ~(1 << (ep & 0x0f));
+  return usb_host_in(hub, ep, size);
 }
 
 bool usb_host_out(uint8_t hub, uint8_t ep, uint8_t* data, uint8_t size) {
-  if (!usb_host_ready(hub) ||
-      !lock_transaction(hub, hub_address[hub] ? hub_address[hub] : 1 + hub)) {
+  if (!usb_host_ready(hub) || yields_to_periodic(hub) ||
+      !lock_transaction(hub, get_device_address(hub))) {
     return false;
   }
   transaction_stage = 2;
   host_out_transfer(hub, ep, data, size, STATE_OUT_DONE, 0);
-  return false;
+  return true;
 }
 
 bool usb_host_hid_get_report(uint8_t hub,
                              uint8_t type,
                              uint8_t id,
                              uint8_t size) {
-  if (!is_hid[hub])
+  if (!is_hid[hub] || size > USB_HOST_BUFFER_SIZE)
     return false;
-  if (!usb_host_ready(hub) ||
-      !lock_transaction(hub, hub_address[hub] ? hub_address[hub] : 1 + hub)) {
+  if (!usb_host_ready(hub) || yields_to_periodic(hub) ||
+      !lock_transaction(hub, get_device_address(hub))) {
     return false;
   }
   hid_get_report.wValue = (type << 8) | id;
@@ -1136,7 +2243,134 @@ bool usb_host_hid_get_report(uint8_t hub,
   return true;
 }
 
+// Returns true if the device finished the enumeration. Transfers on ready
+// devices leave STATE_READY while they are in flight.
+static bool is_enumerated(uint8_t hub) {
+  return state[hub] == STATE_READY || active_request[hub] ||
+         (transaction_lock == (int8_t)hub && !enumerating[hub]);
+}
+
+bool usb_host_submit(uint8_t hub, struct usb_host_request* request) {
+  if ((request->type == USB_HOST_REQ_SETUP &&
+       request->setup->wLength > USB_HOST_BUFFER_SIZE) ||
+      (request->type == USB_HOST_REQ_IN && !request->data &&
+       request->size > USB_HOST_BUFFER_SIZE)) {
+    return false;  // Does not fit in the host buffer.
+  }
+  if ((request->type == USB_HOST_REQ_BULK_IN ||
+       request->type == USB_HOST_REQ_BULK_OUT) &&
+      (!request->data || !ep_max_packet_size[hub][request->ep & 0x0f])) {
+    return false;  // Not an endpoint of the configuration.
+  }
+  // The state and the queue are checked and updated at once against the
+  // interrupt handler.
+  IE_USB = 0;
+  bool accepted =
+      is_enumerated(hub) && queue_count[hub] != USB_HOST_QUEUE_SIZE;
+  if (accepted) {
+    uint8_t tail = (queue_head[hub] + queue_count[hub]) % USB_HOST_QUEUE_SIZE;
+    queue[hub][tail] = request;
+    queue_count[hub]++;
+  }
+  if (use_interrupt())
+    IE_USB = 1;
+  return accepted;
+}
+
+void usb_host_set_quirks(uint8_t hub, uint8_t flags) {
+  quirks[hub] = flags;
+}
+
 void usb_host_hub_switch(uint8_t hub, uint8_t address) {
   hub_address[hub] = address;
   state[hub] = STATE_SET_ADDRESS;
-}
\ No newline at end of file
+}
+uint16_t usb_host_frame(void) {
+  update_frame();
+  return frame_number;
+}
+
+const struct usb_host_stats* usb_host_get_stats(uint8_t hub) {
+  return &stats[hub];
+}
+
+bool usb_host_register_driver(const struct usb_host_driver* driver) {
+  if (driver_count == USB_HOST_MAX_DRIVERS)
+    return false;
+  drivers[driver_count++] = driver;
+  return true;
+}
+
+const struct usb_host_configuration* usb_host_get_configuration(uint8_t hub) {
+  return &configuration[hub];
+}
+
+static void string_complete(uint8_t hub,
+                            void* context,
+                            uint8_t result,
+                            uint8_t* data,
+                            uint16_t size) {
+  context;
+  void (*callback)(uint8_t, uint8_t, const uint8_t*, uint8_t) =
+      string_callback[hub];
+  string_callback[hub] = 0;
+  if (result != USB_HOST_RESULT_OK || size < 2) {
+    data = 0;
+    size = 0;
+  } else if (data[0] < size) {
+    size = data[0];
+  }
+  callback(hub, string_setup[hub].wValue & 0xff, data, size);
+}
+
+bool usb_host_get_string(uint8_t hub,
+                         uint8_t index,
+                         void (*callback)(uint8_t hub,
+                                          uint8_t index,
+                                          const uint8_t* desc,
+                                          uint8_t size)) {
+  if (!index || string_callback[hub]) {
+    return false;
+  }
+  struct usb_setup_req* setup = &string_setup[hub];
+  setup->bRequestType =
+      USB_REQ_DIR_IN | USB_REQ_TYPE_STANDARD | USB_REQ_RECPT_DEVICE;
+  setup->bRequest = USB_GET_DESCRIPTOR;
+  setup->wValue = (USB_DESC_STRING << 8) | index;
+  setup->wIndex = 0x0409;
+  // Devices return the shorter of this and the descriptor at once.
+  setup->wLength = USB_HOST_BUFFER_SIZE;
+  struct usb_host_request* request = &string_request[hub];
+  request->type = USB_HOST_REQ_SETUP;
+  request->ep = 0;
+  request->setup = setup;
+  request->data = 0;
+  request->size = 0;
+  request->timeout_ms = 0;
+  request->complete = string_complete;
+  request->context = 0;
+  if (!usb_host_submit(hub, request)) {
+    return false;
+  }
+  string_callback[hub] = callback;
+  return true;
+}
+
+bool usb_host_cancel(uint8_t hub) {
+  // The interrupt handler should not complete the transfer while it is checked.
+  IE_USB = 0;
+  uint8_t current = state[hub];
+  if (current == STATE_DELAY_US)
+    current = delay_next_state[hub];
+  // Completed transfers are waiting for the callback.
+  bool canceled = transaction_lock == (int8_t)hub && !enumerating[hub] &&
+                  current >= STATE_TRANSACTION;
+  if (canceled) {
+    UH_EP_PID = 0;  // Stop USB transaction.
+    UIF_TRANSFER = 0;
+    complete_transfer(hub, USB_HOST_RESULT_CANCELED);
+  }
+  if (use_interrupt())
+    IE_USB = 1;
+  return canceled;
+}
@@ -9,40 +9,413 @@
 #include <stdint.h>
 
 // Should be included from the main source file to set up interrupt handler.
+#include "../interrupt.h"
 #include "../timer3.h"
 #include "usb.h"
 
+#if defined(__SDCC) && defined(_USB_HOST_INTERRUPT)
+// usb_host_int() takes transfer completions in the interrupt context when
+// USE_INTERRUPT is set. Otherwise, completions are handled in usb_host_poll().
+// Define _USB_HOST_INTERRUPT for all sources to use it, but not together with
+// usb_int() of usb_device.h that takes the same interrupt.
+extern void usb_host_int(void) __interrupt(INT_NO_USB) __using(1);
+#endif
+
 enum {
   USE_HUB0 = 1 << 0,
   USE_HUB1 = 1 << 1,
+  // Ignored unless _USB_HOST_INTERRUPT is defined.
+  USE_INTERRUPT = 1 << 2,
+  // Fetches manufacturer, product, and serial number strings during the
+  // enumeration for check_string_desc.
+  USE_STRING_DESC = 1 << 3,
+};
+
+enum {
+  USB_HOST_REQ_SETUP,
+  USB_HOST_REQ_IN,
+  USB_HOST_REQ_OUT,
+  USB_HOST_REQ_BULK_IN,
+  USB_HOST_REQ_BULK_OUT,
+};
+
+enum {
+  USB_HOST_RESULT_OK,
+  USB_HOST_RESULT_NAK,
+  USB_HOST_RESULT_STALL,
+  USB_HOST_RESULT_DISCONNECTED,
+  USB_HOST_RESULT_TIMEOUT,
+  USB_HOST_RESULT_CANCELED,
+  USB_HOST_RESULT_BABBLE,  // the device sent more than requested
+};
+
+enum {
+  // Waits between stages and packets in a transfer even if the timing does
+  // not require it.
+  USB_HOST_QUIRK_STAGE_GAP = 1 << 0,
+};
+
+// Waits used during the enumeration.
+struct usb_host_timing {
+  uint16_t attach_ms;          // before resetting a newly attached device
+  uint16_t reset_ms;           // bus reset duration
+  uint16_t second_reset_ms;    // bus reset duration after the initial check
+  uint16_t reset_recovery_us;  // after the bus reset
+  uint16_t enable_ms;          // after enabling the port
+  uint16_t set_address_ms;     // after SET_ADDRESS
+  uint16_t request_gap_us;     // between descriptor requests
+  uint16_t settle_ms;          // after configuration changes
+  bool double_reset;           // reset again after the initial device check
+  bool stage_gap;              // wait between stages and packets in a transfer
+};
+
+extern const struct usb_host_timing usb_host_timing_compatible;
+extern const struct usb_host_timing usb_host_timing_fast;
+
+// Number of devices that can be used at once. The `hub` argument of APIs and
+// callbacks identifies a device. 0 and 1 are devices on the root ports, and
+// others are devices behind external hubs. Devices behind hubs are enumerated
+// only if this is larger than 2.
+#ifndef USB_HOST_MAX_DEVICES
+#define USB_HOST_MAX_DEVICES 2
+#endif
+
+// Number of requests that can be queued per device.
+#ifndef USB_HOST_QUEUE_SIZE
+#define USB_HOST_QUEUE_SIZE 4
+#endif
+
+// Size of the buffer that receives descriptors, and transfers without their
+// own destination. Configuration and HID report descriptors are parsed packet
+// by packet, and longer string descriptors are truncated. Other transfers that
+// do not fit fail. Should hold a full speed packet.
+#ifndef USB_HOST_BUFFER_SIZE
+#define USB_HOST_BUFFER_SIZE 64
+#endif
+
+// A request submitted via usb_host_submit(). The caller owns the memory, and
+// should keep it untouched until `complete` is called.
+// For USB_HOST_REQ_SETUP, `data` and `size` are used only for the OUT data
+// stage, and `size` should match `setup->wLength`.
+// For USB_HOST_REQ_IN, received data is passed to `complete`. If `data` is
+// set, the host DMA writes packets directly into it without copying, and it
+// should have room for `size` rounded up to the endpoint max packet size.
+// Even aligned buffers are preferred as DMA addresses must be even. Otherwise,
+// data is valid only inside the callback. IN requests do not retry on NAK, but
+// complete with USB_HOST_RESULT_NAK. IN requests to interrupt endpoints stay
+// in the queue until the endpoint's bInterval passes since the last poll.
+// `timeout_ms` falls back to USB_HOST_TRANSFER_TIMEOUT_MS if it is 0.
+// Control data stages, and IN requests without `data`, go through the host
+// buffer, and should fit in USB_HOST_BUFFER_SIZE.
+// USB_HOST_REQ_BULK_IN and USB_HOST_REQ_BULK_OUT need `data`, and move up to
+// 65535 bytes in packets of the endpoint max packet size. Packets are chained
+// without gaps, and data toggles are kept per endpoint over requests. A short
+// packet ends a bulk IN request, and `complete` receives the size that
+// arrived. Non-control IN requests that receive more than `size` fail with
+// USB_HOST_RESULT_BABBLE. Bulk requests retry on NAK until `timeout_ms` passes.
+struct usb_host_request {
+  uint8_t type;
+  uint8_t ep;
+  const struct usb_setup_req* setup;
+  uint8_t* data;
+  uint16_t size;
+  uint16_t timeout_ms;
+  void (*complete)(uint8_t hub,
+                   void* context,
+                   uint8_t result,
+                   uint8_t* data,
+                   uint16_t size);
+  void* context;
+};
+
+// Transfers that keep receiving NAK fail after this. Requests can set their
+// own, up to 65535ms.
+// Transfers during the enumeration halt the device on timeout.
+#ifndef USB_HOST_TRANSFER_TIMEOUT_MS
+#define USB_HOST_TRANSFER_TIMEOUT_MS 1000
+#endif
+
+// A device on a root port that halts on an unexpected response is reset and
+// enumerated again after USB_HOST_HALT_BACKOFF_MS, doubled on each attempt.
+// Attempts are counted until the device gets ready again, and it stays halted
+// after USB_HOST_HALT_RETRIES failures until it is attached again.
+#ifndef USB_HOST_HALT_RETRIES
+#define USB_HOST_HALT_RETRIES 4
+#endif
+#ifndef USB_HOST_HALT_BACKOFF_MS
+#define USB_HOST_HALT_BACKOFF_MS 50
+#endif
+
+// Number of log2 buckets in the latency histogram of usb_host_stats.
+#ifndef USB_HOST_STATS_BUCKETS
+#define USB_HOST_STATS_BUCKETS 8
+#endif
+
+// Counters per device. They keep counting over connections. Counters updated
+// in the interrupt context may be read in the middle of an update.
+struct usb_host_stats {
+  uint16_t transactions;  // completed packets
+  uint16_t naks;
+  uint16_t stalls;
+  uint16_t retries;  // packets resent after NAK
+  uint16_t halts;
+  uint16_t timeouts;
+  uint16_t resets;          // bus resets and hub port resets
+  uint16_t enumeration_ms;  // from the last reset to the ready state
+  // Transfers by time from the start to the completion in timer3 raw ticks
+  // (62.5us). The bucket `i` counts ones that took [2^i, 2^(i+1)) ticks, and
+  // the first and the last bucket also take shorter and longer ones.
+  uint16_t latency[USB_HOST_STATS_BUCKETS];
+};
+
+// Binary packet trace, enabled by _USB_HOST_TRACE. Records are kept in a ring
+// of USB_HOST_TRACE_SIZE entries, a power of 2 up to 128, and new records are
+// dropped while it is full. `seq` counts all packets so that decoders can find
+// dropped ones.
+#ifndef USB_HOST_TRACE_SIZE
+#define USB_HOST_TRACE_SIZE 32
+#endif
+
+// Number of packet data bytes kept in a record.
+#ifndef USB_HOST_TRACE_DATA
+#define USB_HOST_TRACE_DATA 8
+#endif
+
+// usb_host_trace_drain() sends each record after this byte. The 16-bit tick is
+// little endian. test/trace_decode decodes the stream.
+#define USB_HOST_TRACE_MAGIC 0xa5
+
+// `token` of records for sent packets. Others have the result token.
+#define USB_HOST_TRACE_SEND 0xff
+
+struct usb_host_trace {
+  uint8_t seq;
+  uint16_t tick;   // timer3_tick_raw()
+  uint8_t hub;
+  uint8_t ep_pid;  // PID in the upper 4 bits, and the endpoint in the lower
+  uint8_t token;
+  uint8_t size;    // full packet size even if data is truncated
+  uint8_t data[USB_HOST_TRACE_DATA];
+};
+
+// Limits of the configuration table. Alternate settings do not count, and
+// descriptors beyond the limits are ignored.
+#ifndef USB_HOST_MAX_INTERFACES
+#define USB_HOST_MAX_INTERFACES 6
+#endif
+#ifndef USB_HOST_MAX_ENDPOINTS
+#define USB_HOST_MAX_ENDPOINTS 12
+#endif
+
+struct usb_host_interface {
+  uint8_t number;
+  uint8_t class_code;
+  uint8_t subclass;
+  uint8_t protocol;
+  uint16_t hid_report_desc_length;  // 0 if it has no HID descriptor
+  uint8_t first_endpoint;           // index in usb_host_configuration.endpoint
+  uint8_t endpoints;
+};
+
+struct usb_host_endpoint {
+  uint8_t address;
+  uint8_t attributes;
+  uint16_t max_packet_size;
+  uint8_t interval;
+};
+
+// Configuration descriptor parsed into a table in one pass, and shared by the
+// host core and class drivers. Interfaces in the default setting and their
+// endpoints appear in the descriptor order. Alternate settings are skipped.
+struct usb_host_configuration {
+  uint8_t value;
+  uint8_t attributes;
+  uint16_t total_length;
+  uint16_t hash;  // of the raw descriptor to identify known devices
+  uint8_t interfaces;
+  uint8_t endpoints;
+  struct usb_host_interface interface[USB_HOST_MAX_INTERFACES];
+  struct usb_host_endpoint endpoint[USB_HOST_MAX_ENDPOINTS];
+};
+
+// Parses a configuration descriptor fed in pieces of any size into `conf`.
+struct usb_host_config_parser {
+  struct usb_host_configuration* conf;
+  struct usb_host_interface* intf;  // the interface being parsed, or 0
+  uint16_t offset;
+  uint8_t index;  // position in the current descriptor
+  union {
+    struct usb_desc_head head;
+    struct usb_desc_configuration configuration;
+    struct usb_desc_interface interface;
+    struct usb_desc_hid hid;
+    struct usb_desc_endpoint endpoint;
+  } desc;  // leading bytes of the current descriptor
 };
 
+// Keys that usb_host_id entries compare.
+enum {
+  USB_HOST_MATCH_VENDOR = 1 << 0,
+  USB_HOST_MATCH_PRODUCT = 1 << 1,
+  // Class, subclass, and protocol of the device, or of an interface.
+  USB_HOST_MATCH_CLASS = 1 << 2,
+  // Interface number. The entry matches only interfaces then.
+  USB_HOST_MATCH_INTERFACE = 1 << 3,
+};
+
+// An entry of device ID tables that drivers keep in code flash. Entries
+// without USB_HOST_MATCH_CLASS nor USB_HOST_MATCH_INTERFACE match only on the
+// device descriptor.
+struct usb_host_id {
+  uint8_t match;
+  uint16_t vid;
+  uint16_t pid;
+  uint8_t class_code;
+  uint8_t subclass;
+  uint8_t protocol;
+  uint8_t interface;
+  uint8_t data;  // driver specific, e.g. a device type
+};
+
+// Identity of a device taken from its device descriptor.
+struct usb_host_device {
+  uint16_t vid;
+  uint16_t pid;
+  uint8_t class_code;
+  uint8_t subclass;
+  uint8_t protocol;
+};
+
+// A class driver registered via usb_host_register_driver(). It takes matching
+// devices from the `struct usb_host` client that usb_host_init() receives. The
+// client sees only check_device_desc and disconnected for such devices.
+struct usb_host_driver {
+  const struct usb_host_id* ids;
+  uint8_t id_count;
+  // Called on matching entries when the configuration is known. `intf` is
+  // the matching interface, or 0 for device level matches. Returns true to
+  // take the device.
+  bool (*probe)(uint8_t hub,
+                const struct usb_host_id* id,
+                const struct usb_host_interface* intf);
+  // Called on each usb_host_poll() while the device is ready.
+  void (*poll)(uint8_t hub);
+  // Receives data of usb_host_in() and usb_host_in_data0().
+  void (*report)(uint8_t hub, uint8_t* data, uint16_t size);
+  void (*disconnected)(uint8_t hub);
+};
+
+// Frame numbers wrap as the 11-bit SOF frame number does.
+#define USB_HOST_FRAME_MASK 0x07ff
+
+// Number of drivers that can be registered.
+#ifndef USB_HOST_MAX_DRIVERS
+#define USB_HOST_MAX_DRIVERS 4
+#endif
+
 struct usb_host {
   uint8_t flags;
+  // Falls back to `usb_host_timing_compatible` if not set.
+  const struct usb_host_timing* timing;
   void (*disconnected)(uint8_t hub);
+  // Called when the device halts. `retry` is the recovery attempt that starts,
+  // or 0 if the device stays halted. `disconnected` follows on recovery.
+  void (*halted)(uint8_t hub, uint8_t retry);
   void (*check_device_desc)(uint8_t hub, const uint8_t* desc);
   void (*check_string_desc)(uint8_t hub, uint8_t index, const uint8_t* desc);
-  uint8_t (*check_configuration_desc)(uint8_t hub, const uint8_t* desc);
-  void (*check_hid_report_desc)(uint8_t hub, const uint8_t* desc);
+  // Returns the interface number to use, or 0xff to let the host choose.
+  uint8_t (*check_configuration_desc)(
+      uint8_t hub,
+      const struct usb_host_configuration* conf);
+  // Called with pieces of the HID report descriptor as packets arrive.
+  // `offset` is the position of `data` in the descriptor, and a call with
+  // `size` 0 follows the last piece.
+  void (*check_hid_report_desc)(uint8_t hub,
+                                uint16_t offset,
+                                const uint8_t* data,
+                                uint8_t size);
+  // Returns true if the device is already known after the configuration
+  // descriptor check. String and HID report descriptors are skipped then.
+  bool (*is_cached)(uint8_t hub);
   void (*in)(uint8_t hub, uint8_t* data, uint16_t size);
   void (*hid_report)(uint8_t hub, uint8_t* data, uint16_t size);
+  // Called at the beginning of the first usb_host_poll() in each frame.
+  // `frame` may skip numbers if polls are late.
+  void (*frame)(uint16_t frame);
 };
 
 void usb_host_init(struct usb_host* host);
 void usb_host_reset(void);
 void usb_host_poll(void);
+// Runs usb_host_poll() steps until `max_ticks` timer3 raw ticks (62.5us) pass,
+// or 0 for no limit. It stops between states, and a step that runs a callback
+// can go over the budget. Returns true if work is left for the next call.
+bool usb_host_poll_budget(uint16_t max_ticks);
 bool usb_host_ready(uint8_t hub);
 bool usb_host_idle(void);
+// Control and OUT transfers fail while interrupt IN endpoints of other devices
+// are due, so that polls are not delayed by background traffic.
 bool usb_host_setup(uint8_t hub,
                     const struct usb_setup_req* req,
                     const uint8_t* data);
+// Interrupt IN endpoints are polled at most once per bInterval ms. Requests
+// made earlier fail so that the bus stays free for others.
+// Data toggles of non-control endpoints are kept per device and endpoint, and
+// reset on SET_CONFIGURATION and CLEAR_FEATURE(ENDPOINT_HALT). IN packets that
+// repeat the last toggle are resent ones, and dropped. A transfer takes the
+// device's toggle after a few drops in a row. Data is delivered only if the
+// transfer succeeds.
 bool usb_host_in(uint8_t hub, uint8_t ep, uint8_t size);
+// Starts over from DATA0 for devices that reset the toggle on their own.
 bool usb_host_in_data0(uint8_t hub, uint8_t ep, uint8_t size);
 bool usb_host_out(uint8_t hub, uint8_t ep, uint8_t* data, uint8_t size);
 bool usb_host_hid_get_report(uint8_t hub,
                              uint8_t type,
                              uint8_t id,
                              uint8_t size);
+// Quirks are cleared on each connection. Set them in check_device_desc.
+void usb_host_set_quirks(uint8_t hub, uint8_t flags);
 void usb_host_hub_switch(uint8_t hub, uint8_t address);
+// Queues a request on an enumerated device, also while other transfers of the
+// device are in flight. Returns false if the queue is full.
+bool usb_host_submit(uint8_t hub, struct usb_host_request* request);
+// Aborts the transfer in progress on a ready device. It completes with
+// USB_HOST_RESULT_CANCELED, and the bus is released in the next
+// usb_host_poll(). Returns false if the device has no transfer in progress.
+bool usb_host_cancel(uint8_t hub);
+// Reads the string descriptor `index` of a ready device in the US English
+// language via the request queue. `callback` receives the descriptor
+// truncated to USB_HOST_BUFFER_SIZE, or 0 on failure. Returns false if
+// another string request is pending on the device, or the queue is full.
+bool usb_host_get_string(uint8_t hub,
+                         uint8_t index,
+                         void (*callback)(uint8_t hub,
+                                          uint8_t index,
+                                          const uint8_t* desc,
+                                          uint8_t size));
+// Returns the frame number that advances every 1ms in a fixed phase to SOF.
+uint16_t usb_host_frame(void);
+const struct usb_host_stats* usb_host_get_stats(uint8_t hub);
+// Returns the table of the configuration in use, valid while the device stays
+// connected.
+const struct usb_host_configuration* usb_host_get_configuration(uint8_t hub);
+// Registers a class driver. Drivers are matched in the registration order.
+// Returns false if there is no room.
+bool usb_host_register_driver(const struct usb_host_driver* driver);
+// Returns the first entry of `ids` that matches the device, or 0. If `intf` is
+// set, class and interface number entries are compared with the interface
+// instead.
+const struct usb_host_id* usb_host_match(const struct usb_host_id* ids,
+                                         uint8_t count,
+                                         const struct usb_host_device* device,
+                                         const struct usb_host_interface* intf);
+void usb_host_parse_configuration_begin(struct usb_host_config_parser* parser,
+                                        struct usb_host_configuration* conf);
+void usb_host_parse_configuration(struct usb_host_config_parser* parser,
+                                  const uint8_t* data,
+                                  uint16_t size);
+// Passes pending trace records to `send` one by one, and returns the number of
+// them. `send` can be cdc_device_send(), or a wrapper of Serial.putc().
+uint8_t usb_host_trace_drain(void (*send)(const uint8_t* data, uint8_t size));
 
 #endif  // __usb_host_h__
\ No newline at end of file
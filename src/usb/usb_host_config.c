@@ -0,0 +1,131 @@
+// Copyright 2021 Takashi Toyoshima <toyoshim@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "usb_host.h"
+
+static void parse_descriptor(struct usb_host_config_parser* parser) {
+  struct usb_host_configuration* conf = parser->conf;
+  if (parser->index < sizeof(struct usb_desc_head)) {
+    return;
+  }
+  switch (parser->desc.head.bDescriptorType) {
+    case USB_DESC_CONFIGURATION:
+      conf->value = parser->desc.configuration.bConfigurationValue;
+      conf->attributes = parser->desc.configuration.bmAttributes;
+      conf->total_length = parser->desc.configuration.wTotalLength;
+      break;
+    case USB_DESC_INTERFACE: {
+      const struct usb_desc_interface* d = &parser->desc.interface;
+      // Alternate settings are never selected, and must not take slots that
+      // later interfaces, e.g. HID after audio streaming ones, need.
+      if (d->bAlternateSetting != 0 ||
+          conf->interfaces == USB_HOST_MAX_INTERFACES) {
+        parser->intf = 0;
+        break;
+      }
+      struct usb_host_interface* intf = &conf->interface[conf->interfaces++];
+      intf->number = d->bInterfaceNumber;
+      intf->class_code = d->bInterfaceClass;
+      intf->subclass = d->bInterfaceSubClass;
+      intf->protocol = d->bInterfaceProtocol;
+      intf->hid_report_desc_length = 0;
+      intf->first_endpoint = conf->endpoints;
+      intf->endpoints = 0;
+      parser->intf = intf;
+      break;
+    }
+    case USB_DESC_HID:
+      if (parser->intf) {
+        parser->intf->hid_report_desc_length =
+            parser->desc.hid.wDescriptorLength;
+      }
+      break;
+    case USB_DESC_ENDPOINT: {
+      if (!parser->intf || conf->endpoints == USB_HOST_MAX_ENDPOINTS) {
+        break;
+      }
+      const struct usb_desc_endpoint* d = &parser->desc.endpoint;
+      struct usb_host_endpoint* ep = &conf->endpoint[conf->endpoints++];
+      ep->address = d->bEndpointAddress;
+      ep->attributes = d->bmAttributes;
+      ep->max_packet_size = d->wMaxPacketSize;
+      ep->interval = d->bInterval;
+      parser->intf->endpoints++;
+      break;
+    }
+  }
+}
+
+void usb_host_parse_configuration_begin(struct usb_host_config_parser* parser,
+                                        struct usb_host_configuration* conf) {
+  parser->conf = conf;
+  parser->intf = 0;
+  parser->offset = 0;
+  parser->index = 0;
+  conf->value = 0;
+  conf->attributes = 0;
+  // Known once the configuration descriptor itself arrives.
+  conf->total_length = 0xffff;
+  conf->hash = 0;
+  conf->interfaces = 0;
+  conf->endpoints = 0;
+}
+
+void usb_host_parse_configuration(struct usb_host_config_parser* parser,
+                                  const uint8_t* data,
+                                  uint16_t size) {
+  struct usb_host_configuration* conf = parser->conf;
+  for (uint16_t i = 0; i < size && parser->offset < conf->total_length; ++i) {
+    uint16_t hash = conf->hash;
+    conf->hash = ((hash << 5) | (hash >> 11)) ^ data[i];
+    parser->offset++;
+    // Only leading bytes that the table needs are kept.
+    if (parser->index < sizeof(parser->desc)) {
+      ((uint8_t*)&parser->desc)[parser->index] = data[i];
+    }
+    parser->index++;
+    if (parser->index == parser->desc.head.bLength) {
+      parse_descriptor(parser);
+      parser->index = 0;
+    }
+  }
+}
+
+const struct usb_host_id* usb_host_match(
+    const struct usb_host_id* ids,
+    uint8_t count,
+    const struct usb_host_device* device,
+    const struct usb_host_interface* intf) {
+  const uint8_t interface_keys =
+      USB_HOST_MATCH_CLASS | USB_HOST_MATCH_INTERFACE;
+  for (uint8_t i = 0; i < count; ++i) {
+    const struct usb_host_id* id = &ids[i];
+    const uint8_t match = id->match;
+    if (intf ? !(match & interface_keys)
+             : (match & USB_HOST_MATCH_INTERFACE)) {
+      continue;
+    }
+    if ((match & USB_HOST_MATCH_VENDOR) && id->vid != device->vid) {
+      continue;
+    }
+    if ((match & USB_HOST_MATCH_PRODUCT) && id->pid != device->pid) {
+      continue;
+    }
+    if (match & USB_HOST_MATCH_CLASS) {
+      if (intf ? (id->class_code != intf->class_code ||
+                  id->subclass != intf->subclass ||
+                  id->protocol != intf->protocol)
+               : (id->class_code != device->class_code ||
+                  id->subclass != device->subclass ||
+                  id->protocol != device->protocol)) {
+        continue;
+      }
+    }
+    if ((match & USB_HOST_MATCH_INTERFACE) && id->interface != intf->number) {
+      continue;
+    }
+    return id;
+  }
+  return 0;
+}
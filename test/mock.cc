@@ -4,13 +4,31 @@
 
 #include "mock.h"
 
+#include <string.h>
+
 struct usb_host* usb_host = nullptr;
+uint8_t flash_data[1024];
 
 extern "C" {
 
+#include "flash.h"
 #include "led.h"
 #include "timer3.h"
 
+bool flash_write(uint16_t offset, const uint8_t* data, uint16_t size) {
+  if (offset < 4 || sizeof(flash_data) < offset + size)
+    return false;
+  memcpy(&flash_data[offset], data, size);
+  return true;
+}
+
+bool flash_read(uint16_t offset, uint8_t* data, uint16_t size) {
+  if (sizeof(flash_data) < offset + size)
+    return false;
+  memcpy(data, &flash_data[offset], size);
+  return true;
+}
+
 void led_oneshot(uint8_t shot) {}
 
 uint16_t timer3_tick_raw() {
@@ -61,4 +79,8 @@ bool usb_host_hid_get_report(uint8_t hub,
 }
 
 void usb_host_hub_switch(uint8_t hub, uint8_t address) {}
+
+bool usb_host_submit(uint8_t hub, struct usb_host_request* request) {
+  return false;
+}
 }
\ No newline at end of file
@@ -10,5 +10,6 @@ extern "C" {
 }
 
 extern struct usb_host* usb_host;
+extern uint8_t flash_data[1024];
 
 #endif  // __mock_h__
\ No newline at end of file
@@ -3,6 +3,7 @@
 // in the LICENSE file.
 
 #include <stdint.h>
+#include <string.h>
 
 extern "C" {
 #include "serial.h"
@@ -41,6 +42,7 @@ struct DummyConfigurationDescriptor {
       USB_DESC_HID_REPORT,  0x0000,
   };
 } usb_conf_desc;
+usb_host_configuration usb_conf;
 
 class CompatTest : public ::testing::Test {
  protected:
@@ -57,14 +59,36 @@ class CompatTest : public ::testing::Test {
     usb_host->check_device_desc(
         0, reinterpret_cast<const uint8_t*>(&usb_device_desc));
     usb_conf_desc.hid.wDescriptorLength = report_size;
-    usb_host->check_configuration_desc(
-        0, reinterpret_cast<const uint8_t*>(&usb_conf_desc));
+    usb_host_config_parser parser;
+    usb_host_parse_configuration_begin(&parser, &usb_conf);
+    usb_host_parse_configuration(
+        &parser, reinterpret_cast<const uint8_t*>(&usb_conf_desc),
+        sizeof(usb_conf_desc));
+    usb_host->check_configuration_desc(0, &usb_conf);
+  }
+
+  void EnableCache(uint8_t entries) {
+    memset(flash_data, 0xff, sizeof(flash_data));
+    hid.cache_offset = 4;
+    hid.cache_entries = entries;
+    hid_init(&hid);
+  }
+
+  void SetOnChange(void (*on_change)(uint8_t, const hid_gamepad_state*)) {
+    hid.on_change = on_change;
+    hid_init(&hid);
   }
 
   void CheckHidReportDescriptor(const uint8_t* desc) {
     ASSERT_TRUE(usb_host->check_hid_report_desc);
 
-    usb_host->check_hid_report_desc(0, desc);
+    // Feed the descriptor in pieces as low-speed packets arrive.
+    const uint16_t size = usb_conf_desc.hid.wDescriptorLength;
+    for (uint16_t offset = 0; offset < size; offset += 8) {
+      uint8_t piece = (size - offset < 8) ? (size - offset) : 8;
+      usb_host->check_hid_report_desc(0, offset, desc + offset, piece);
+    }
+    usb_host->check_hid_report_desc(0, size, nullptr, 0);
   }
 
   void CheckHidInfo(hid_info& expected, hid_info& actual) {
@@ -473,6 +497,94 @@ TEST_F(PS4PseudoCompatTest, WirelessController_DualShock4_CUH_ZCT2J) {
   CheckHidInfo(expected, *hid_get_info(0));
 }
 
+TEST_F(PS4PseudoCompatTest, DecodeReport) {
+  const uint8_t pseudo_hid_report_desc[] = {
+      0x85, 0x01, 0x95, 0x04, 0x75, 0x08, 0x05, 0x01, 0x09, 0x30, 0x05, 0x01,
+      0x09, 0x31, 0x05, 0x01, 0x09, 0x32, 0x05, 0x01, 0x09, 0x35, 0x81, 0x02,
+      0x95, 0x01, 0x75, 0x04, 0x05, 0x01, 0x09, 0x39, 0x81, 0x42, 0x95, 0x0e,
+      0x75, 0x01, 0x2a, 0x0e, 0x00, 0x1a, 0x01, 0x00, 0x81, 0x02, 0x95, 0x01,
+      0x75, 0x06, 0x06, 0x00, 0xff, 0x09, 0x20, 0x81, 0x02, 0x95, 0x02, 0x75,
+      0x08, 0x05, 0x01, 0x09, 0x33, 0x05, 0x01, 0x09, 0x34, 0x81, 0x02, 0x95,
+      0x36, 0x75, 0x08, 0x06, 0x00, 0xff, 0x09, 0x21, 0x81, 0x02,
+  };
+  SetReportSize(sizeof(pseudo_hid_report_desc));
+  CheckHidReportDescriptor(pseudo_hid_report_desc);
+
+  uint8_t report[64] = {
+      0x01,                    // report ID
+      0x00, 0xff, 0x80, 0x80,  // X, Y, Z, Rz
+      0x12,                    // hat: east, button 1
+      0x00, 0x00,              // buttons 2-13
+      0xff, 0x00,              // Rx, Ry
+  };
+  hid_gamepad_state state;
+  ASSERT_TRUE(hid_decode(0, report, sizeof(report), &state));
+  EXPECT_EQ(1 << HID_BUTTON_1, state.buttons);
+  EXPECT_EQ(HID_DPAD_RIGHT, state.dpad);
+  EXPECT_EQ(-32768, state.axis[0]);
+  EXPECT_EQ(32512, state.axis[1]);
+  EXPECT_EQ(0, state.axis[2]);
+  EXPECT_EQ(0, state.axis[3]);
+  EXPECT_EQ(32512, state.axis[4]);
+  EXPECT_EQ(-32768, state.axis[5]);
+
+  EXPECT_FALSE(hid_decode(0, report, 9, &state));
+  report[0] = 0x02;
+  EXPECT_FALSE(hid_decode(0, report, sizeof(report), &state));
+}
+
+TEST_F(PS4PseudoCompatTest, NotifyChangesOnly) {
+  static int changes;
+  static hid_gamepad_state last;
+  changes = 0;
+  SetOnChange([](uint8_t hub, const hid_gamepad_state* state) {
+    changes++;
+    last = *state;
+  });
+  const uint8_t pseudo_hid_report_desc[] = {
+      0x85, 0x01, 0x95, 0x04, 0x75, 0x08, 0x05, 0x01, 0x09, 0x30, 0x05, 0x01,
+      0x09, 0x31, 0x05, 0x01, 0x09, 0x32, 0x05, 0x01, 0x09, 0x35, 0x81, 0x02,
+      0x95, 0x01, 0x75, 0x04, 0x05, 0x01, 0x09, 0x39, 0x81, 0x42, 0x95, 0x0e,
+      0x75, 0x01, 0x2a, 0x0e, 0x00, 0x1a, 0x01, 0x00, 0x81, 0x02, 0x95, 0x01,
+      0x75, 0x06, 0x06, 0x00, 0xff, 0x09, 0x20, 0x81, 0x02, 0x95, 0x02, 0x75,
+      0x08, 0x05, 0x01, 0x09, 0x33, 0x05, 0x01, 0x09, 0x34, 0x81, 0x02, 0x95,
+      0x36, 0x75, 0x08, 0x06, 0x00, 0xff, 0x09, 0x21, 0x81, 0x02,
+  };
+  SetReportSize(sizeof(pseudo_hid_report_desc));
+  CheckHidReportDescriptor(pseudo_hid_report_desc);
+
+  uint8_t report[64] = {
+      0x01,                    // report ID
+      0x80, 0x80, 0x80, 0x80,  // X, Y, Z, Rz
+      0x18,                    // hat: null, button 1
+      0x00, 0x00,              // buttons 2-13
+      0x80, 0x80,              // Rx, Ry
+  };
+  usb_host->in(0, report, sizeof(report));
+  EXPECT_EQ(1, changes);
+  EXPECT_EQ(1 << HID_BUTTON_1, last.buttons);
+
+  // Repeated reports, and a change in a vendor field, are suppressed.
+  usb_host->in(0, report, sizeof(report));
+  report[7] = 0xfc;
+  usb_host->in(0, report, sizeof(report));
+  EXPECT_EQ(1, changes);
+
+  report[5] = 0x08;
+  usb_host->in(0, report, sizeof(report));
+  EXPECT_EQ(2, changes);
+  EXPECT_EQ(0, last.buttons);
+
+  // Held buttons are released on disconnection.
+  report[5] = 0x18;
+  usb_host->in(0, report, sizeof(report));
+  EXPECT_EQ(3, changes);
+  usb_host->disconnected(0);
+  EXPECT_EQ(4, changes);
+  EXPECT_EQ(0, last.buttons);
+  EXPECT_EQ(0, hid_get_gamepad_state(0)->buttons);
+}
+
 TEST_F(PS4PseudoCompatTest, VictrixProFSwithTouchPadForPS4) {
   const uint8_t pseudo_hid_report_desc[] = {
       0x85, 0x01, 0x95, 0x01, 0x75, 0x08, 0x05, 0x01, 0x09, 0x30, 0x81, 0x02,
@@ -770,6 +882,30 @@ TEST_F(SwitchPseudoCompatTest, RetroArcadeStick) {
   CheckHidInfo(expected, *hid_get_info(0));
 }
 
+// Compatibility tests for Xbox controllers without HID descriptors
+using XboxCompatTest = CompatTest;
+
+TEST_F(XboxCompatTest, XboxOneControllerTriggers) {
+  SetVendorAndProduct(0x045e, 0x02d1);
+  SetReportSize(0);
+  ASSERT_EQ(HID_TYPE_XBOX_ONE, hid_get_info(0)->type);
+
+  uint8_t report[18] = {0x20};
+  hid_gamepad_state state;
+  ASSERT_TRUE(hid_decode(0, report, sizeof(report), &state));
+  EXPECT_EQ(-32768, state.axis[4]);
+  EXPECT_EQ(-32768, state.axis[5]);
+
+  // Triggers are 10-bit values in 16-bit fields.
+  report[6] = 0xff;
+  report[7] = 0x03;
+  report[8] = 0x00;
+  report[9] = 0x02;
+  ASSERT_TRUE(hid_decode(0, report, sizeof(report), &state));
+  EXPECT_EQ(32704, state.axis[4]);
+  EXPECT_EQ(0, state.axis[5]);
+}
+
 // Compatibility tests for other controllers with precised descriptors
 using GenericCompatTest = CompatTest;
 
@@ -938,4 +1074,92 @@ TEST_F(GenericPseudoCompatTest, G920DrivingForceRacingWheelForXboxOne) {
   CheckHidInfo(expected, *hid_get_info(0));
 }
 
+TEST_F(GenericPseudoCompatTest, LogicalRangesAndPushPop) {
+  const uint8_t pseudo_hid_report_desc[] = {
+      0x05, 0x01, 0x09, 0x05, 0xa1, 0x01, 0x85, 0x01, 0xa4, 0x15, 0x00, 0x26,
+      0xff, 0x03, 0x75, 0x10, 0x95, 0x02, 0x09, 0x30, 0x09, 0x31, 0x81, 0x02,
+      0xb4,  // 10-bit X and Y in 16-bit fields, inside Push and Pop
+      0x15, 0x81, 0x25, 0x7f, 0x75, 0x08, 0x95, 0x02, 0x09, 0x32, 0x09, 0x35,
+      0x81, 0x02,  // signed Z and Rz
+      0x05, 0x09, 0x19, 0x01, 0x29, 0x10, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01,
+      0x95, 0x10, 0x81, 0x02, 0xc0,  // 16 buttons
+      0x85, 0x02, 0x05, 0x01, 0x09, 0x30, 0x75, 0x08, 0x95, 0x01, 0x81, 0x02,
+  };
+  hid_info expected = {
+      sizeof(pseudo_hid_report_desc),
+      64,
+      {0, 16, 32, 40, 0xffff, 0xffff},
+      0xffff,
+      {0xffff, 0xffff, 0xffff, 0xffff},
+      {48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60},
+      {16, 16, 8, 8},
+      {6, 6, 0, 0},
+      {false, false, true, true, false, false},
+      {false, false, false, false, false, false},
+      1,
+      HID_TYPE_GENERIC,
+      HID_STATE_READY,
+  };
+
+  SetReportSize(sizeof(pseudo_hid_report_desc));
+  CheckHidReportDescriptor(pseudo_hid_report_desc);
+  CheckHidInfo(expected, *hid_get_info(0));
+  for (size_t i = 0; i < 4; ++i)
+    EXPECT_EQ(expected.axis_shift[i], hid_get_info(0)->axis_shift[i]);
+
+  const uint8_t report[] = {
+      0x01, 0xff, 0x03, 0x00, 0x02, 0x81, 0x7f, 0x01, 0x00,
+  };
+  hid_gamepad_state state;
+  ASSERT_TRUE(hid_decode(0, report, sizeof(report), &state));
+  EXPECT_EQ(32704, state.axis[0]);
+  EXPECT_EQ(0, state.axis[1]);
+  EXPECT_EQ(-32512, state.axis[2]);
+  EXPECT_EQ(32512, state.axis[3]);
+  EXPECT_EQ(1 << HID_BUTTON_1, state.buttons);
+}
+
+// Tests for the enumeration result cache
+using CacheTest = CompatTest;
+
+TEST_F(CacheTest, RestoreKnownDevice) {
+  const uint8_t hid_report_desc[] = {
+      0x05, 0x01, 0x09, 0x05, 0xa1, 0x01, 0x15, 0x00, 0x25, 0x01, 0x35,
+      0x00, 0x45, 0x01, 0x75, 0x01, 0x95, 0x0e, 0x05, 0x09, 0x19, 0x01,
+      0x29, 0x0e, 0x81, 0x02, 0x95, 0x02, 0x81, 0x01, 0x05, 0x01, 0x25,
+      0x07, 0x46, 0x3b, 0x01, 0x75, 0x04, 0x95, 0x01, 0x65, 0x14, 0x09,
+      0x39, 0x81, 0x42, 0x65, 0x00, 0x95, 0x01, 0x81, 0x01, 0x26, 0xff,
+      0x00, 0x46, 0xff, 0x00, 0x09, 0x30, 0x09, 0x31, 0x09, 0x32, 0x09,
+      0x35, 0x75, 0x08, 0x95, 0x04, 0x81, 0x02, 0xc0,
+  };
+  EnableCache(4);
+  SetVendorAndProduct(0x0f0d, 0x00c1);
+  SetDevice(0x0572);
+  SetReportSize(sizeof(hid_report_desc));
+  EXPECT_FALSE(usb_host->is_cached(0));
+  CheckHidReportDescriptor(hid_report_desc);
+  hid_info expected = *hid_get_info(0);
+  EXPECT_EQ(HID_TYPE_GENERIC, expected.type);
+
+  // Reconnect. The report descriptor check result should be restored, while
+  // the device gets ready only after the enumeration.
+  SetReportSize(sizeof(hid_report_desc));
+  EXPECT_TRUE(usb_host->is_cached(0));
+  expected.state = HID_STATE_NOT_READY;
+  CheckHidInfo(expected, *hid_get_info(0));
+
+  // Other revisions are handled as unknown devices.
+  SetDevice(0x0573);
+  SetReportSize(sizeof(hid_report_desc));
+  EXPECT_FALSE(usb_host->is_cached(0));
+  EXPECT_EQ(HID_STATE_NOT_READY, hid_get_info(0)->state);
+  SetDevice(0);
+}
+
+TEST_F(CacheTest, Disabled) {
+  SetReportSize(16);
+  EXPECT_FALSE(usb_host->is_cached(0));
+  EXPECT_EQ(HID_STATE_NOT_READY, hid_get_info(0)->state);
+}
+
 }  // namespace anonymous
@@ -0,0 +1,100 @@
+// Copyright 2021 Takashi Toyoshima <toyoshim@gmail.com>. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be found
+// in the LICENSE file.
+
+// Decodes usb_host trace records sent by usb_host_trace_drain().
+// Usage: trace_decode [-d data_bytes] [file]
+// `data_bytes` should match USB_HOST_TRACE_DATA of the firmware. Reads stdin
+// if `file` is not specified.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+namespace {
+
+constexpr uint8_t kMagic = 0xa5;
+constexpr uint8_t kSend = 0xff;
+constexpr size_t kHeaderSize = 7;
+constexpr double kUsecPerTick = 62.5;
+
+const char* PidName(uint8_t pid) {
+  switch (pid) {
+    case 0x0:
+      return "-";
+    case 0x1:
+      return "OUT";
+    case 0x2:
+      return "ACK";
+    case 0x3:
+      return "DATA0";
+    case 0x9:
+      return "IN";
+    case 0xa:
+      return "NAK";
+    case 0xb:
+      return "DATA1";
+    case 0xd:
+      return "SETUP";
+    case 0xe:
+      return "STALL";
+  }
+  return "?";
+}
+
+void Print(const uint8_t* record, size_t data_bytes, int* last_tick) {
+  uint8_t seq = record[0];
+  uint16_t tick = record[1] | (record[2] << 8);
+  uint8_t hub = record[3];
+  uint8_t ep_pid = record[4];
+  uint8_t token = record[5];
+  uint8_t size = record[6];
+  double delta =
+      (*last_tick < 0) ? 0 : (uint16_t)(tick - *last_tick) * kUsecPerTick;
+  *last_tick = tick;
+  printf("%3u %5u %+9.1fus hub%u ep%u %-5s ", seq, tick, delta, hub,
+         ep_pid & 0x0f, PidName(ep_pid >> 4));
+  if (token == kSend) {
+    printf("send ");
+  } else {
+    printf("recv %-5s ", PidName(token));
+  }
+  printf("%3u:", size);
+  for (size_t i = 0; i < size && i < data_bytes; ++i)
+    printf(" %02x", record[kHeaderSize + i]);
+  if (size > data_bytes)
+    printf(" ...");
+  printf("\n");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  size_t data_bytes = 8;
+  FILE* in = stdin;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-d") && (i + 1) < argc) {
+      data_bytes = atoi(argv[++i]);
+    } else if (!(in = fopen(argv[i], "rb"))) {
+      perror(argv[i]);
+      return 1;
+    }
+  }
+  std::vector<uint8_t> record(kHeaderSize + data_bytes);
+  int last_tick = -1;
+  int last_seq = -1;
+  for (int c; (c = fgetc(in)) != EOF;) {
+    if (c != kMagic)
+      continue;  // Resynchronize.
+    if (fread(record.data(), 1, record.size(), in) != record.size())
+      break;
+    if (last_seq >= 0 && (uint8_t)(last_seq + 1) != record[0])
+      printf("--- %u records lost\n", (uint8_t)(record[0] - last_seq - 1));
+    last_seq = record[0];
+    Print(record.data(), data_bytes, &last_tick);
+  }
+  return 0;
+}